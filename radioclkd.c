@@ -10,9 +10,8 @@
  * The idea to take the average time of the best pulses in the last
  * minute is that of Jon Atkins <jon@jonatkins.com>
  *
- * The algorithm for UTCtime was taken from the mktime routine in libntp, though
- * none of the original code was used, with much of the detail removed for our
- * somewhat limited requirements here.
+ * The algorithm for UTCtime is the days from civil date calculation described
+ * by Howard Hinnant, rather than a search using the system gmtime().
  *
  * Note: The DCF77 transmitter is located at 50:01N,9:00E
  *       The MSF transmitter is located at 52:22N,1:11W
@@ -103,8 +102,11 @@
 
 static const char rcsid[]="$Id: radioclkd.c,v 2.5 2003/01/20 16:48:33 jab Exp jab $";
 
+#define _GNU_SOURCE
 #include<stdio.h>
 #include<stdlib.h>
+#include<stdint.h>
+#include<stdarg.h>
 #include<math.h>
 #include<unistd.h>
 #include<time.h>
@@ -121,11 +123,101 @@ static const char rcsid[]="$Id: radioclkd.c,v 2.5 2003/01/20 16:48:33 jab Exp ja
 #include<syslog.h>
 #include<paths.h>
 #include<string.h>
-#include<setjmp.h>
+#include<stddef.h>
+#include<errno.h>
+#include<pthread.h>
+#include<sys/file.h>
+#include<sys/epoll.h>
+#include<sys/signalfd.h>
+#include<sys/timerfd.h>
+#include<sys/eventfd.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<linux/tty.h>
+#ifdef HAVE_SYS_TIMEPPS_H
+#include<sys/timepps.h>
+#else
+#include<linux/pps.h>
+#endif
+#include "radioclkstat.h"
 
 
 #define PID_FILE _PATH_VARRUN "radioclkd.pid"
 
+#ifndef N_PPS
+#define N_PPS 18
+#endif
+
+#ifndef HAVE_SYS_TIMEPPS_H
+/*
+ * Minimal RFC 2783 PPS API on top of the Linux PPS ioctls, for use when the
+ * timepps.h header from pps-tools is not installed.
+ */
+typedef int pps_handle_t;
+typedef struct pps_kparams pps_params_t;
+typedef struct {
+	unsigned long assert_sequence;
+	unsigned long clear_sequence;
+	struct timespec assert_timestamp;
+	struct timespec clear_timestamp;
+	int current_mode;
+} pps_info_t;
+
+static int time_pps_create(int source, pps_handle_t *handle)
+{
+	*handle = source;
+	return 0;
+}
+
+/* as with pps-tools the handle is the file descriptor, which the caller
+   closes */
+static int time_pps_destroy(pps_handle_t handle)
+{
+	return 0;
+}
+
+static int time_pps_getcap(pps_handle_t handle, int *mode)
+{
+	return ioctl(handle, PPS_GETCAP, mode);
+}
+
+static int time_pps_getparams(pps_handle_t handle, pps_params_t *params)
+{
+	return ioctl(handle, PPS_GETPARAMS, params);
+}
+
+static int time_pps_setparams(pps_handle_t handle, const pps_params_t *params)
+{
+	return ioctl(handle, PPS_SETPARAMS, params);
+}
+
+static int time_pps_fetch(pps_handle_t handle, const int tsformat,
+	pps_info_t *info, const struct timespec *timeout)
+{
+	struct pps_fdata fdata;
+
+	memset(&fdata, 0, sizeof(fdata));
+	if (timeout==NULL) {
+		fdata.timeout.flags = PPS_TIME_INVALID;
+	} else {
+		fdata.timeout.sec = timeout->tv_sec;
+		fdata.timeout.nsec = timeout->tv_nsec;
+	}
+	if (ioctl(handle, PPS_FETCH, &fdata)!=0)
+		return -1;
+
+	info->assert_sequence = fdata.info.assert_sequence;
+	info->clear_sequence = fdata.info.clear_sequence;
+	info->assert_timestamp.tv_sec = fdata.info.assert_tu.sec;
+	info->assert_timestamp.tv_nsec = fdata.info.assert_tu.nsec;
+	info->clear_timestamp.tv_sec = fdata.info.clear_tu.sec;
+	info->clear_timestamp.tv_nsec = fdata.info.clear_tu.nsec;
+	info->current_mode = fdata.info.current_mode;
+
+	return 0;
+}
+#endif
+
 /*
  * NTPD shared memory reference clock driver structure
  */
@@ -141,9 +233,330 @@ struct shmTime {
 	int     precision;
 	int     nsamples;
 	int     valid;
-	int     dummy[10];
+	unsigned clockTimeStampNSec;
+	unsigned receiveTimeStampNSec;
+	int     dummy[8];
+};
+
+/*
+ * Extended SHM segment, the original structure followed by a ring of the
+ * last SHM_SAMPLES samples so a reader polling less often than once a second
+ * loses none of them. Readers that only know the original structure attach
+ * to the start of the segment and see the latest sample as before.
+ *
+ * Each slot is a seqlock, its sequence odd while it is being written, and
+ * the head counts every sample ever written. A reader takes the samples it
+ * has not seen from the head back, checking the sequence of a slot is the
+ * same even number before and after copying it out and that the slot still
+ * holds the sample it wanted.
+ */
+#define SHM_RING_MAGIC 0x52434c4b
+#define SHM_RING_VERSION 1
+#define SHM_SAMPLES 64
+
+struct shmSample {
+	uint32_t seq;
+	uint32_t index;
+	int64_t clockSec;
+	int64_t receiveSec;
+	uint32_t clockNSec;
+	uint32_t receiveNSec;
+	int32_t leap;
+	int32_t precision;
+};
+
+struct shmRing {
+	struct shmTime legacy;
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t head;
+	struct shmSample sample[SHM_SAMPLES];
+};
+
+/*
+ * Sample pushed to the SOCK reference clock driver of chrony as a datagram,
+ * the offset being that of the true time from the system time at tv
+ */
+#define SOCK_MAGIC 0x534f434b
+
+struct sockSample {
+	struct timeval tv;
+	double offset;
+	int pulse;
+	int leap;
+	int _pad;
+	int magic;
+};
+
+/*
+ * The seconds of a time code packed one bit per second, the most recent
+ * second in bit 63. Each plane records whether the carrier was off during
+ * part of the second, which between them tell every pulse type apart:
+ *
+ *   100ms  -       DCF77 0, MSF A=0 B=0
+ *   200ms  a       DCF77 1, MSF A=1 B=0, WWVB 0
+ *   300ms  a b     MSF A=1 B=1
+ *   bit B  b       MSF A=0 B=1
+ *   500ms  a b c   MSF minute marker, WWVB 1
+ *   800ms  a b c d WWVB marker
+ *
+ * A second in which no pulse of a known length was seen is an erasure, set
+ * in plane e alone.
+ */
+struct frameBits {
+	uint64_t a;
+	uint64_t b;
+	uint64_t c;
+	uint64_t d;
+	uint64_t e;
+};
+
+#define SYMBOL_ERASED (-1)
+
+/*
+ * A BCD digit of a time code, the second it starts in, its width in bits and
+ * the field and weight it has in the decoded time
+ */
+struct bcdDigit {
+	unsigned char second;
+	unsigned char width;
+	unsigned char field;
+	unsigned char weight;
+};
+
+enum { FIELD_MIN, FIELD_HOUR, FIELD_MDAY, FIELD_WDAY, FIELD_MON, FIELD_YEAR,
+	FIELD_YDAY, FIELDS };
+
+/*
+ * Bit of each second of the frame when a decoder is called. DCF77 is decoded
+ * at the start of the minute marker, MSF and WWVB at the end of it.
+ */
+#define DCF77_OFFSET 5
+#define MSF_OFFSET 3
+#define WWVB_OFFSET 3
+
+#define SECOND(s,offset) ((uint64_t) 1<<((s)+(offset)))
+#define SECONDS(s,n,offset) ((((uint64_t) 1<<(n))-1)<<((s)+(offset)))
+#define Parity(x) (__builtin_popcountll(x) & 1)
+
+/* planes set by each of the pulse types 0-5 from ProcessStatusChange */
+static const unsigned char symbolPlanes[6] = { 0x0, 0x1, 0x3, 0x2, 0x7, 0xf };
+
+/*
+ * A sliding window of the offsets of the pulses from the system clock, held
+ * both in order of arrival in a ring and in order of offset in a treap with
+ * the ring slots as its nodes, so order statistics and trimmed means can be
+ * had at any time in O(log n)
+ */
+#define WINDOW_MAX 128
+
+struct windowNode {
+	long value;
+	unsigned priority;
+	int left;
+	int right;
+	int size;
+	long long sum;
 };
 
+struct offsetWindow {
+	int size;
+	int head;
+	int count;
+	int root;
+	int run;
+	unsigned seed;
+	unsigned long rejected;
+	time_t stamp[WINDOW_MAX];
+	struct windowNode node[WINDOW_MAX];
+};
+
+/* a pulse further than this in ns from the second or the median is ignored */
+#define MAX_OFFSET 128000000
+#define MAX_SPREAD 50000000
+
+/*
+ * A two state Kalman filter tracking the phase and frequency of the system
+ * clock against the second markers, in ns and ns/s
+ */
+struct trackFilter {
+	int updates;
+	int rejects;
+	struct timespec last;
+	double phase;
+	double freq;
+	double p00;
+	double p01;
+	double p11;
+};
+
+/* white phase noise of the system clock in ns^2/s, random walk of its
+   frequency in ns^2/s^3 and the initial variance of its frequency */
+#define FILTER_PHASE_NOISE 1e6
+#define FILTER_FREQ_NOISE 1e2
+#define FILTER_FREQ_VAR 2.5e11
+
+/* noise variance in ns^2 assumed for the second markers until there are
+   enough in the window to measure it, and the least it is taken to be */
+#define FILTER_NOISE 1e14
+#define FILTER_MIN_NOISE 2.5e9
+
+/* innovations more than FILTER_GATE standard deviations out are rejected,
+   FILTER_REJECTS of them in a row or a gap of FILTER_GAP seconds restarts
+   the filter, and its output is used after FILTER_SETTLE updates */
+#define FILTER_GATE 5.0
+#define FILTER_REJECTS 10
+#define FILTER_GAP 1000
+#define FILTER_SETTLE 10
+
+/*
+ * The classes of pulse width learned for a line, in the order of the symbols
+ * of the decoder with the gap before MSF bit B in place of symbol 3. Each is
+ * a centre and variance in ms, seeded from the fixed windows of old. A
+ * receiver that stretches or shrinks its pulses, or drifts with temperature,
+ * moves every class by much the same, so the centres follow the pulses as a
+ * stretch common to all the classes plus a smaller one of each class. The
+ * gap before bit B shrinks as much as the 100ms pulse before it stretches.
+ */
+#define WIDTH_CLASSES 6
+
+struct widthClasses {
+	double stretch;
+	double own[WIDTH_CLASSES];
+	double centre[WIDTH_CLASSES];
+	double spread[WIDTH_CLASSES];
+	unsigned long seen[WIDTH_CLASSES];
+};
+
+/* by default a pulse is put in the nearest class within four standard
+   deviations, but no less than WIDTH_HALF or more than WIDTH_WIDEST ms, of
+   its centre, and a gap in the bit B class within WIDTH_HALF ms of its
+   centre. The common stretch follows the pulses over WIDTH_GAIN pulses up to
+   WIDTH_SHIFT ms, and that of each class four times slower up to half as
+   far. Each line can be given its own in the configuration file. */
+#define WIDTH_HALF 45.0
+#define WIDTH_WIDEST 60.0
+#define WIDTH_GAIN 32.0
+#define WIDTH_SHIFT 40.0
+
+/* serial ports that can be used at once */
+#define MAX_PORTS 8
+
+/* longest path of a chrony socket, leaving room for the unit number */
+#define SOCKET_PATH 104
+
+/*
+ * The settings of a line, from the command line or the configuration file.
+ * All of them can be changed while running, a unit of -1 being the default
+ * of three units for each port in turn.
+ */
+struct lineConfig {
+	int protocols;
+	int unit;
+	int average;
+	long delay;
+	int located;
+	double latitude;
+	double longitude;
+	double widthHalf;
+	double widthWidest;
+	double widthGain;
+	double widthShift;
+	char chrony[SOCKET_PATH];
+};
+
+/*
+ * The settings read from the configuration file, those of the ports that
+ * can only be set at start up along with those of their lines. Global
+ * settings not given in the file are -1 or empty.
+ */
+struct portConfig {
+	char devname[64];
+	int poll;
+	int kernelpps;
+	char recorddir[256];
+	struct lineConfig line[3];
+};
+
+struct config {
+	int errors;
+	int seconds;
+	char latency[256];
+	char state[256];
+	int nports;
+	struct portConfig port[MAX_PORTS];
+};
+
+/*
+ * The widths in ms of the pulses seen in each second, kept over several
+ * minutes for the soft decoder, along with whether a second pulse followed
+ * as for MSF bit B
+ */
+#define SOFT_SECONDS 600
+
+struct softFrame {
+	time_t second[SOFT_SECONDS];
+	short width[SOFT_SECONDS];
+	unsigned char extra[SOFT_SECONDS];
+	int last;
+};
+
+/* minutes either side of the system clock that are tried, as for the check
+   on hard decoded times, and the number of time codes this needs encoded */
+#define SOFT_SKEW 1000
+#define SOFT_MINUTES 48
+
+/* the standard deviation of the pulse widths in ms, the longest width
+   kept, and the chance of a spurious pulse or a second marker being lost */
+#define SOFT_WIDTH 25.0
+#define SOFT_MAX_WIDTH 1000
+#define SOFT_SPURIOUS 0.01
+#define SOFT_DROP 0.05
+
+/* the winning minute must be this much more likely than the next in log
+   likelihood, and match this fraction of at least SOFT_SEEN pulses */
+#define SOFT_MARGIN 20.0
+#define SOFT_AGREE 0.75
+#define SOFT_SEEN 90
+
+/* no pulse, 100ms, 200ms, 300ms, 500ms, 800ms and MSF bit B */
+#define SOFT_TYPES 7
+
+/*
+ * The time code expected in the current minute once locked on to a decoded
+ * time, and how well the pulses received have matched it
+ */
+struct lockState {
+	int locked;
+	int radio;
+	time_t origin;
+	time_t minute;
+	time_t pending;
+	int good;
+	int errors;
+	int bad;
+	int verified;
+	signed char expect[60];
+};
+
+/* a minute checks out with at least LOCK_SEEN pulses as expected, LOCK_BAD
+   minutes in a row with too many errors or LOCK_GAP seconds without a pulse
+   loses the lock */
+#define LOCK_SEEN 10
+#define LOCK_BAD 2
+#define LOCK_GAP 3600
+
+/* second markers agreeing on their phase within the second before pulses
+   out of phase are ignored, and the pulses out of phase in a row after which
+   the phase is learnt again */
+#define PHASE_LOCK 4
+#define PHASE_MISSES 10
+
+/* seconds without a pulse after which second markers can no longer be
+   labeled until the next minute is decoded */
+#define MAX_FLYWHEEL 10
+
 /*
  * Holds all the state information about a clock receiver
  */
@@ -154,43 +567,407 @@ struct clockInfo {
 	int frame;
 	int correct;
 	unsigned char marker;
-	struct timeval start;
-	struct timeval end;
+	struct timespec start;
+	struct timespec end;
 	int unit;
 	time_t last;
 	struct shmTime *stamp;
-	char line[4];
-	char code[128];
-	struct timeval pulses[128];
+	struct shmRing *ring;
+	struct lineStats *stats;
+	struct lineStats ownStats;
+	struct lineStats *shared;
+	struct latencyHist *latency;
+	int sockfd;
+	int sockerror;
+	int ppsfd;
+	pps_handle_t pps;
+	unsigned long assert;
+	unsigned long clear;
+	char line[32];
+	struct frameBits bits;
+	struct offsetWindow offsets;
+	struct softFrame soft;
+	struct lockState lock;
+	struct widthClasses widths;
+	struct lineConfig config;
+	int radio;
+	long delay;
+	long phase;
+	int phaseHits;
+	int phaseMisses;
+	time_t second;
+	struct timespec ended;
+	time_t published;
+	struct timespec pulse;
+	struct trackFilter filter;
+	int precision;
+	time_t label;
+	struct timespec labeled;
+	struct savedLine *saved;
+	int warm;
+	int warmErrors;
+};
+
+
+/*
+ * Counts of the work done by a capture thread, so the number of system calls
+ * needed per edge can be checked
+ */
+struct portCounters {
+	unsigned long edges;
+	unsigned long timeouts;
+	unsigned long waits;
+	unsigned long gets;
+	unsigned long fetches;
+	unsigned long sleeps;
+	unsigned long notifies;
+};
+
+/*
+ * Histogram of latencies in ns, in buckets a quarter of an octave wide so
+ * that any latency up to 2^40ns is placed within 19%. Each histogram has a
+ * single writer, and is read while being written when dumped, so a dump may
+ * be a sample or so out.
+ */
+#define HIST_SUB 4
+#define HIST_BUCKETS 160
+
+struct latencyHist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t bucket[HIST_BUCKETS];
+};
+
+/* the stages between an edge and its time stamp being published */
+enum { LATENCY_IRQ, LATENCY_GET, LATENCY_QUEUE, LATENCY_EDGE, LATENCY_DECODE,
+	LATENCY_STAGES };
+
+/* period in ns of the wake up latency probe, and in seconds of the dump of
+   the histograms to a file */
+#define PROBE_INTERVAL 1000000L
+#define LATENCY_PERIOD 60
+
+/*
+ * An edge handed from the capture thread of a port to its worker thread, the
+ * status word of the port and the time stamp for each line. A status of -1
+ * is a time out with no edge.
+ */
+struct edgeEvent {
+	int status;
+	struct timespec ts;
+	struct timespec edge[3];
+	uint64_t queued;
+};
+
+/*
+ * Lock free single producer, single consumer queue of edges from the capture
+ * thread of a port to its worker thread. The head and the counters kept with
+ * it are only written by the capture thread, the tail only by the worker, and
+ * each is in a cache line of its own. The worker sleeps on the eventfd.
+ */
+#define EDGE_QUEUE 256
+#define CACHE_LINE 64
+
+struct edgeQueue {
+	unsigned int head __attribute__ ((aligned (CACHE_LINE)));
+	unsigned int deepest;
+	unsigned long overflows;
+	unsigned int tail __attribute__ ((aligned (CACHE_LINE)));
+	int fd;
+	struct edgeEvent event[EDGE_QUEUE];
+};
+
+/*
+ * Edge recording file, a header followed by one record per edge giving the
+ * time stamp and modem status word, all in host byte order
+ */
+#define RECORD_MAGIC "RCLKEDGE"
+#define RECORD_VERSION 1
+
+struct recordHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+};
+
+struct edgeRecord {
+	int64_t sec;
+	int32_t nsec;
+	int32_t status;
+};
+
+/*
+ * State file the tracking state of each line is checkpointed to as every
+ * second marker arrives, so that a restart can carry on from it. Each line
+ * is guarded by a sequence lock as for the statistics, so one left half
+ * written is not used. The file is only for radioclkd itself, so the
+ * structures are kept as they are in memory, one of another size being
+ * started afresh.
+ */
+#define STATE_MAGIC "RCLKWARM"
+#define STATE_VERSION 1
+
+struct savedLine {
+	uint32_t seq;
+	char name[32];
+	time_t saved;
+	long phase;
+	int phaseHits;
+	time_t last;
+	time_t published;
+	struct lockState lock;
+	struct trackFilter filter;
+	struct widthClasses widths;
+};
+
+struct stateFile {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+	struct savedLine line[MAX_PORTS*3];
+};
+
+/* second markers that must agree with the state carried over before the
+   seconds are labeled from it, the pulses of them that may be other than
+   expected, and the period in seconds the state file is flushed to disk */
+#define WARM_SECONDS 8
+#define WARM_ERRORS 1
+#define STATE_PERIOD 60
+
+/*
+ * Phase of the start of the pulses on a line, as learnt by the predictive
+ * polling engine
+ */
+struct pollPhase {
+	int locked;
+	int hits;
+	long phase;
+	long spread;
+	time_t seen;
+};
+
+/*
+ * Holds all the state information about a serial port and the clock
+ * receivers attached to its DCD, CTS and DSR lines
+ */
+struct portInfo {
+	int fd;
+	int poll;
+	int kernelpps;
+	int timeout;
+	int failed;
+	unsigned long idle;
+	unsigned long wakeups;
+	pthread_t thread;
+	pthread_t worker;
+	struct portCounters counters;
+	struct latencyHist latency[LATENCY_STAGES];
+	struct edgeQueue queue;
+	int state;
+	int captured;
+	struct timespec sample;
+	struct pollPhase phase[3];
+	char *recorddir;
+	FILE *record;
+	int recorded;
+	struct lineConfig config[3];
+	struct lineConfig reload[3];
+	int reloading;
+	char devname[64];
+	char *name;
+	struct clockInfo line[3];
+};
+
+
+/*
+ * Parameters and state of the synthetic time signal generator
+ */
+struct generator {
+	int radio;
+	time_t start;
+	int minutes;
+	long delay;
+	long jitter;
+	long asymmetry;
+	double glitch;
+	double drop;
+	double fade;
+	int fadelen;
+	int faded;
+	int dut1;
+	uint64_t seed;
+	FILE *trace;
+	struct portInfo *port;
+	struct timespec last;
+};
+
+/*
+ * Results of a benchmark run of the decoder against a synthetic signal
+ */
+struct benchInfo {
+	struct shmRing shm;
+	struct timespec edge;
+	time_t start;
+	int minutes;
+	long delay;
+	int decoded;
+	int wrong;
+	long *latency;
+	long *offset;
 };
 
+/* pulse types of the generator, the length the carrier is reduced in ms */
+enum { SYMBOL_NONE=0, SYMBOL_100=100, SYMBOL_200=200, SYMBOL_300=300,
+	SYMBOL_500=500, SYMBOL_800=800, SYMBOL_B=-1 };
+
 
 /*
  * Globals, no less
  */
-int serial;
-int poll;
+#define STACK_SIZE (64*1024)
+
+/* seconds without an edge before a capture thread is woken up */
+#define SERIAL_TIMEOUT 10
+
+/* returned instead of the line status when the port itself has failed, and
+   the seconds a capture thread waits before trying it again */
+#define SERIAL_FAILED -2
+#define SERIAL_RETRY 1
+
+/* longest wait in seconds for the receivers to power up, and how often in
+   ns their lines are looked at meanwhile */
+#define POWER_UP_WAIT 5
+#define POWER_UP_POLL 10000000L
+
+/*
+ * Predictive polling, all times in nanoseconds. Until the phase of the pulse
+ * starts on a line is known the port is polled every POLL_COARSE, after that
+ * every POLL_BACKGROUND with POLL_FINE polling in a window around the
+ * expected start of each pulse.
+ */
+#define POLL_COARSE 5000000L
+#define POLL_BACKGROUND 20000000L
+#define POLL_FINE 100000L
+#define POLL_WINDOW_MIN 1000000L
+#define POLL_WINDOW_MAX 10000000L
+#define POLL_CAPTURE 5000000L
+#define POLL_LOCK 3
+#define POLL_UNLOCK 10
+
 int test;
-jmp_buf saved;
-struct clockInfo dcd,cts,dsr;
+int replay;
+int averageWindow = 59;
+int perSecond;
+int softReady;
+int lockErrors = 4;
+struct statsSegment *statistics;
+char *latencyFile;
+char *configFile;
+struct config fileConfig;
+char *stateFile;
+struct stateFile *state;
+struct savedLine carried[MAX_PORTS*3];
+int probeCPU = -1;
+struct latencyHist probeLatency;
+float softLikelihood[SOFT_TYPES][SOFT_MAX_WIDTH+1];
+struct benchInfo *bench;
+int nports;
+struct portInfo ports[MAX_PORTS];
+
+/* centres in ms of the windows the pulse widths were once fixed to */
+const double widthSeed[WIDTH_CLASSES] = { 105.0, 205.0, 305.0, 105.0, 505.0,
+	805.0 };
+
+/* names of the latency stages, for the dumps */
+const char *latencyName[LATENCY_STAGES] = { "interrupt", "tiocmget", "queue",
+	"edge", "decode" };
+
+/* status bits and names of the lines a receiver may be attached to */
+const int lineMask[3] = { TIOCM_CD, TIOCM_CTS, TIOCM_DSR };
+const char *lineName[3] = { "DCD", "CTS", "DSR" };
 
 
 enum { MSF=0x01, DCF77=0x02, WWVB=0x04, JJY=0x08 };
 enum { LEAP_NOWARNING=0x00, LEAP_NOTINSYNC=0x03};
+enum { DECODE_FORMAT=-1, DECODE_NONE=-2, DECODE_PARITY=-3, DECODE_RANGE=-4 };
+enum { PER_SECOND_OFF, PER_SECOND_RAW, PER_SECOND_MEAN };
 
 
-/* Accuracy is assumed to be 2^PRECISION seconds -10 is approximately 980uS */
+/* Accuracy is assumed to be 2^PRECISION seconds -10 is approximately 980uS,
+   unless the tracking filter has settled when it is estimated, though never
+   better than 2^PRECISION_MIN seconds */
 #define PRECISION (-10)
+#define PRECISION_MIN (-20)
+
+/* mean radius of the earth in km, and the speed the signal travels at in
+   km/s, taken as that of light as the ground wave is slower by far less than
+   the time stamps can resolve */
+#define EARTH_RADIUS 6371.0
+#define SIGNAL_SPEED 299792.458
+
+/*
+ * The transmitters of the time signals decoded, in degrees north and east
+ */
+struct transmitter {
+	int radio;
+	const char *name;
+	double latitude;
+	double longitude;
+};
+
+const struct transmitter transmitters[] = {
+	{ DCF77, "DCF77", 50.0+(1.0/60.0), 9.0 },
+	{ MSF, "MSF", 52.0+(22.0/60.0), -(1.0+(11.0/60.0)) },
+	{ WWVB, "WWVB", 40.0+(40.0/60.0), -(105.0+(3.0/60.0)) },
+	{ 0, NULL, 0.0, 0.0 }
+};
 
 #define VERSION_STRING "\
 radioclkd version 1.0\n\
 Copyright (c) 2001-03 Jonathan A. Buzzard <jonathan@buzzard.org.uk>\n"
 
 #define USAGE_STRING "\
-Usage: radioclkd [-t] [-p] device\n\
-Decode the time from a radio clock(s) attached to a serial port\n\n\
+Usage: radioclkd [-t] [-a secs] [-e n] [-s raw|mean] [-c path] [-L file]\n\
+                 [-P cpu] [-f file] [-S file] [[-p] [-k] [-r dir]\n\
+                 [-l lat,lon] [-d ms] device]...\n\
+       radioclkd [-t] [-c path] [-l lat,lon] [-d ms] -R file\n\
+       radioclkd [-t] [-c path] [-l lat,lon] [-d ms] -G spec [-w file]\n\
+       radioclkd -B [-G spec]\n\
+       radioclkd -T\n\
+Decode the time from a radio clock(s) attached to serial port(s), one daemon\n\
+driving every port\n\n\
   -t,--test     print pulse lengths and times to stdout\n\
-  -p,--poll     poll the serial port instead of using interrupts\n\
+  -a,--average secs  average the offset of the pulses over this many\n\
+                seconds, default 59\n\
+  -e,--errors n  bit errors tolerated in a minute once locked, default 4\n\
+  -s,--seconds raw|mean  send every second to ntpd once the minute is known,\n\
+                as received or with the averaged offset\n\
+  -c,--chrony path  send the time stamps to the chrony SOCK reference\n\
+                clock at path.unit as they happen, instead of through\n\
+                shared memory\n\
+  -L,--latency file  write the latency histograms to file every minute\n\
+  -P,--probe cpu  measure the wake up latency of a real time thread on cpu\n\
+  -f,--config file  use the serial ports and settings in file, read again\n\
+                on SIGHUP\n\
+  -S,--state file  save the tracking state to file, and carry on from it\n\
+                when restarted\n\
+  -p,--poll     poll the following serial ports instead of using interrupts\n\
+  -k,--kernel-pps  use kernel PPS time stamps for the DCD line of the\n\
+                following serial ports\n\
+  -r,--record dir  record every edge on the following serial ports to\n\
+                dir/port.edges\n\
+  -l,--location lat,lon  the receivers on the following serial ports are\n\
+                at this latitude and longitude in degrees north and east,\n\
+                take off the time the signal takes to reach them\n\
+  -d,--delay ms[,ms,ms]  take off this delay of the receivers on the DCD,\n\
+                CTS and DSR lines of the following serial ports\n\
+  -R,--replay file  replay recorded edges and print the time stamps that\n\
+                would have been sent to ntpd\n\
+  -G,--generate spec  decode a synthetic signal, see the manual page\n\
+  -w,--write file  write the synthetic signal to file instead\n\
+  -B,--bench    benchmark the decoder against synthetic signals\n\
+  -T,--selftest  check the date arithmetic against the C library\n\
   -h,--help     display this help message\n\
   -v,--version  display version\n\
 Report bugs to jonathan@buzzard.org.uk\n"
@@ -199,234 +976,369 @@ Report bugs to jonathan@buzzard.org.uk\n"
 /*
  * Like mktime but ignores the current time zone and daylight savings, expects
  * an already normalized tm stuct, and does not recompute tm_yday and tm_wday.
+ *
+ * The day number is computed directly from the civil date, counting years
+ * from March so that the leap day falls at the end of the year, and 400 year
+ * eras in which the calendar repeats exactly. It makes no library calls and
+ * so is safe to call from several threads at once.
  */
-time_t UTCtime(struct tm *timeptr)
+time_t UTCtime(const struct tm *timeptr)
 {
-	int bits,direction,secs;
-	struct tm search;
-	time_t timep;
+	long year,era,yoe,doy,doe,days;
+	int mon;
 
 
-	/* calculate the number of magnitude bits in a time_t */
-	for (bits=0,timep=1;timep>0;bits++,timep<<=1)
-		;
+	/* normalize the month into the year */
+	year = 1900L+timeptr->tm_year+timeptr->tm_mon/12;
+	mon = timeptr->tm_mon%12;
+	if (mon<0) {
+		mon += 12;
+		year--;
+	}
 
-	/* if time_t is signed, 0 is the median value else 1<<bits is median */
-	timep = (timep<0) ? 0 : ((time_t) 1<<bits);
+	/* years starting on the 1st of March, January and February being the
+	   last two months of the previous year */
+	if (mon<2)
+		year--;
+	era = ((year>=0) ? year : year-399)/400;
+	yoe = year-era*400;
+	doy = (153*((mon>1) ? mon-2 : mon+10)+2)/5+timeptr->tm_mday-1;
+	doe = yoe*365+yoe/4-yoe/100+doy;
+
+	/* days since the 1st of January 1970, which is day 719468 of the era
+	   beginning on the 1st of March 0000 */
+	days = era*146097+doe-719468;
+
+	return (time_t) days*86400+timeptr->tm_hour*3600+timeptr->tm_min*60+
+		timeptr->tm_sec;
+}
 
-	/* save the seconds, and take them out of the search */
-	secs = timeptr->tm_sec;
-	timeptr->tm_sec = 0;
 
-	/* binary search of the time space using the system gmtime() function */
-	for (;;) {
-	        search = *gmtime(&timep);
+/*
+ * Replace the most recent second of a frame with a pulse type
+ */
+void SetSymbol(struct frameBits *f, int symbol)
+{
+	uint64_t top = (uint64_t) 1<<63;
+
+	f->a &= ~top;
+	f->b &= ~top;
+	f->c &= ~top;
+	f->d &= ~top;
+	f->e &= ~top;
+	if (symbol==SYMBOL_ERASED) {
+		f->e |= top;
+		return;
+	}
+	f->a |= (uint64_t) (symbolPlanes[symbol] & 0x01)<<63;
+	f->b |= (uint64_t) ((symbolPlanes[symbol]>>1) & 0x01)<<63;
+	f->c |= (uint64_t) ((symbolPlanes[symbol]>>2) & 0x01)<<63;
+	f->d |= (uint64_t) ((symbolPlanes[symbol]>>3) & 0x01)<<63;
 
-		/* compare the two times down to the same day */
-		if (((direction = (search.tm_year-timeptr->tm_year))==0) &&
-		    ((direction = (search.tm_mon-timeptr->tm_mon))==0))
-			direction = (search.tm_mday-timeptr->tm_mday);
+	return;
+}
 
-		/* compare the rest of the way if necesary */
-		if (direction==0) {
-			if (((direction = (search.tm_hour-timeptr->tm_hour))==0) &&
-			    ((direction = (search.tm_min-timeptr->tm_min))==0))
-				direction = search.tm_sec-timeptr->tm_sec;
-		}
 
-		/* is the search complete? */
-		if (direction==0) {
-			timeptr->tm_sec	= secs;
-			return timep+secs;
-		} else {
-			if (bits--<0)
-				return -1;
-			if (bits<0)
-				timep--;
-			else if (direction>0)
-				timep -= (time_t) 1 << bits;
-			else
-				timep += (time_t) 1 << bits;
-		}
+/*
+ * Add a second to a frame
+ */
+void PushSymbol(struct frameBits *f, int symbol)
+{
+	f->a >>= 1;
+	f->b >>= 1;
+	f->c >>= 1;
+	f->d >>= 1;
+	f->e >>= 1;
+	SetSymbol(f, symbol);
+
+	return;
+}
+
+
+/*
+ * Pulse type of a second in a frame, age 0 being the most recent, or
+ * SYMBOL_ERASED
+ */
+int FrameSymbol(struct frameBits *f, int age)
+{
+	int i,bits;
+
+	i = 63-age;
+	if ((f->e>>i) & 1)
+		return SYMBOL_ERASED;
+	bits = ((f->a>>i) & 1) | (((f->b>>i) & 1)<<1) | (((f->c>>i) & 1)<<2) |
+		(((f->d>>i) & 1)<<3);
+	for (i=0;i<6;i++)
+		if (symbolPlanes[i]==bits)
+			return i;
+
+	return SYMBOL_ERASED;
+}
+
+
+/*
+ * Fill in a single erased bit in a group covered by a parity bit, so that
+ * the group has the parity given. Returns -1 if more than one bit is erased.
+ */
+static inline int ParityFill(uint64_t *bits, uint64_t erased, uint64_t mask,
+	int parity)
+{
+	erased &= mask;
+	if (erased==0)
+		return 0;
+	if (erased&(erased-1))
+		return -1;
+	if (Parity(*bits & mask)!=parity)
+		*bits |= erased;
+
+	return 0;
+}
+
+
+/*
+ * Extract the BCD fields of a time code from a bit plane, using the table of
+ * digits for the protocol. MSF and WWVB send the most significant bit first.
+ */
+static inline void DecodeBCD(uint64_t bits, const struct bcdDigit *digit,
+	int n, int offset, int msbfirst, int *field)
+{
+	static const unsigned char reverse[16] = { 0x0, 0x8, 0x4, 0xc, 0x2,
+		0xa, 0x6, 0xe, 0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf };
+	int i,x;
+
+	memset(field, 0, FIELDS*sizeof(int));
+	for (i=0;i<n;i++) {
+		x = (bits>>(digit[i].second+offset)) &
+			((1<<digit[i].width)-1);
+		if (msbfirst==1)
+			x = reverse[x]>>(4-digit[i].width);
+		field[digit[i].field] += x*digit[i].weight;
 	}
 
-	return -1;
+	return;
 }
 
 
 /*
- * Decode the DCF77 signal. Return time since epoc on success, -1 on error.
+ * Decode the DCF77 signal. Return time since epoc on success, DECODE_FORMAT,
+ * DECODE_PARITY or DECODE_RANGE on error.
  *
  * Note: We shift time from CET to UTC which is more useful for our purposes
  */
-time_t DecodeDCF77(char *code, int length)
+time_t DecodeDCF77(struct frameBits *f)
 {
-	int bcd[] = { 4,3,1,4,2,1,4,2,3,4,1,4,4 };
-	int parity[] = { 8,7,23 };
-	int segment[13];
-	int i,j,k,sum;
+	static const struct bcdDigit digits[] = {
+		{ 21, 4, FIELD_MIN, 1 }, { 25, 3, FIELD_MIN, 10 },
+		{ 29, 4, FIELD_HOUR, 1 }, { 33, 2, FIELD_HOUR, 10 },
+		{ 36, 4, FIELD_MDAY, 1 }, { 40, 2, FIELD_MDAY, 10 },
+		{ 42, 3, FIELD_WDAY, 1 },
+		{ 45, 4, FIELD_MON, 1 }, { 49, 1, FIELD_MON, 10 },
+		{ 50, 4, FIELD_YEAR, 1 }, { 54, 4, FIELD_YEAR, 10 }
+	};
+	int field[FIELDS];
+	uint64_t one;
 	struct tm decoded;
 
 
-	/* check the parity bits */
-	k = length-38;
-	for(i=0;i<3;i++) {
-		sum = 0;
-		for(j=0;j<parity[i];j++,k++)
-			sum += code[k];
-		if ((sum%2)!=0)
-			return -1;
+	/* the time code must be made up of 100ms and 200ms pulses only, and
+	   the start of time bit 20 is always a one */
+	if ((f->b | f->c | f->d) & SECONDS(21, 38, DCF77_OFFSET))
+		return DECODE_FORMAT;
+	one = f->a;
+	if (((one | f->e) & SECOND(20, DCF77_OFFSET))==0)
+		return DECODE_FORMAT;
+
+	/* the summer time bits must differ, so one erased is the other's
+	   inverse */
+	if (f->e & SECOND(17, DCF77_OFFSET)) {
+		if (f->e & SECOND(18, DCF77_OFFSET))
+			return DECODE_FORMAT;
+		if ((one & SECOND(18, DCF77_OFFSET))==0)
+			one |= SECOND(17, DCF77_OFFSET);
+	} else if (((f->e & SECOND(18, DCF77_OFFSET))==0) &&
+			(((one>>(17+DCF77_OFFSET)) ^ (one>>(18+DCF77_OFFSET))) &
+			1)==0) {
+		return DECODE_PARITY;
 	}
 
-	/* calculate all the individual BCD segments */
-	k = length-38;
-	for(i=0;i<13;i++) {
-		sum = 0;
-		for(j=0;j<bcd[i];j++,k++)
-			sum += ((code[k]==1) ? 1 : 0) << j;
-		segment[i] = sum;
-	}
+	/* a single erased second in each group is given by its parity bit */
+	if ((ParityFill(&one, f->e, SECONDS(21, 8, DCF77_OFFSET), 0)<0) ||
+			(ParityFill(&one, f->e, SECONDS(29, 7, DCF77_OFFSET),
+			0)<0) ||
+			(ParityFill(&one, f->e, SECONDS(36, 23, DCF77_OFFSET),
+			0)<0))
+		return DECODE_PARITY;
 
-	/* decode the BCD segments into the time */
-	decoded.tm_year = 100+segment[11]+(segment[12]*10);
-	decoded.tm_mon = segment[9]+(segment[10]*10)-1;
-	decoded.tm_mday = segment[6]+(segment[7]*10);
-	decoded.tm_wday = segment[8];
+	/* check the parity bits */
+	if (Parity(one & SECONDS(21, 8, DCF77_OFFSET)) ||
+			Parity(one & SECONDS(29, 7, DCF77_OFFSET)) ||
+			Parity(one & SECONDS(36, 23, DCF77_OFFSET)))
+		return DECODE_PARITY;
+
+	/* decode the BCD digits into the time */
+	DecodeBCD(one, digits, sizeof(digits)/sizeof(digits[0]),
+		DCF77_OFFSET, 0, field);
+	memset(&decoded, 0, sizeof(decoded));
+	decoded.tm_year = 100+field[FIELD_YEAR];
+	decoded.tm_mon = field[FIELD_MON]-1;
+	decoded.tm_mday = field[FIELD_MDAY];
+	decoded.tm_wday = field[FIELD_WDAY];
 	if (decoded.tm_wday==7)
 		decoded.tm_wday = 0;
-	decoded.tm_hour = segment[3]+(segment[4]*10);
-	decoded.tm_min = segment[0]+(segment[1]*10);
-	decoded.tm_sec = 0;
-	decoded.tm_isdst = 0;
+	decoded.tm_hour = field[FIELD_HOUR];
+	decoded.tm_min = field[FIELD_MIN];
 
 	/* some extra sanity checks */
 	if ((decoded.tm_min>59) || (decoded.tm_hour>23) ||
 			(decoded.tm_wday>6) || (decoded.tm_mday>31) ||
 			(decoded.tm_mon>11) ||(decoded.tm_year>199))
-		return -1;
+		return DECODE_RANGE;
 
 	/* return adjusted for CET and DST */
-	return (UTCtime(&decoded)-((code[length-42]==1) ? 7200 : 3600));
+	return (UTCtime(&decoded)-((one & SECOND(17, DCF77_OFFSET)) ?
+		7200 : 3600));
 }
 
 
 /*
- * Decode the MSF signal. Return time since epoc on success, -1 on error.
+ * Decode the MSF signal. Return time since epoc on success, DECODE_FORMAT,
+ * DECODE_PARITY or DECODE_RANGE on error.
  */
-time_t DecodeMSF(char *code, int length)
+time_t DecodeMSF(struct frameBits *f)
 {
-	int bcd[] = { 4,4,1,4,2,4,3,2,4,3,4 };
-	int parity[] = { 8,11,3,13 };
-	int segment[11];
-	int i,j,k,sum;
+	static const struct bcdDigit digits[] = {
+		{ 17, 4, FIELD_YEAR, 10 }, { 21, 4, FIELD_YEAR, 1 },
+		{ 25, 1, FIELD_MON, 10 }, { 26, 4, FIELD_MON, 1 },
+		{ 30, 2, FIELD_MDAY, 10 }, { 32, 4, FIELD_MDAY, 1 },
+		{ 36, 3, FIELD_WDAY, 1 },
+		{ 39, 2, FIELD_HOUR, 10 }, { 41, 4, FIELD_HOUR, 1 },
+		{ 45, 3, FIELD_MIN, 10 }, { 48, 4, FIELD_MIN, 1 }
+	};
+	static const uint64_t parity[] = {
+		SECONDS(17, 8, MSF_OFFSET), SECONDS(25, 11, MSF_OFFSET),
+		SECONDS(36, 3, MSF_OFFSET), SECONDS(39, 13, MSF_OFFSET)
+	};
+	int i,field[FIELDS];
+	uint64_t a,b;
 	struct tm decoded;
 
 
-	/* check the parity bits */
-	k = length-44;
-	for(i=0;i<4;i++) {
-		sum = (code[length-7+i]==2) ? 1 : 0;
-		for(j=0;j<parity[i];j++,k++)
-			sum += code[k];
-		if ((sum%2)!=1)
-			return -1;
-	}
+	/* the A and B bits, excluding the minute marker */
+	a = f->a & ~f->c;
+	b = f->b & ~f->c;
 
-	/* calculate all the individual BCD segments */
-	k = length-44;
-	for(i=0;i<11;i++) {
-		sum = 0;
-		for(j=0;j<bcd[i];j++,k++)
-			sum += ((code[k]==1) ? 1 : 0) << (bcd[i]-j-1);
-		segment[i] = sum;
+	/* the parity and summer time bits cannot be erased */
+	if (f->e & SECONDS(54, 5, MSF_OFFSET))
+		return DECODE_FORMAT;
+
+	/* check the odd parity of each group of A bits with its B bit, a
+	   single erased second in a group being given by the parity */
+	for (i=0;i<4;i++) {
+		if (ParityFill(&a, f->e, parity[i],
+				1^((b>>(54+i+MSF_OFFSET)) & 1))<0)
+			return DECODE_PARITY;
+		if ((Parity(a & parity[i]) ^
+				((b>>(54+i+MSF_OFFSET)) & 1))!=1)
+			return DECODE_PARITY;
 	}
 
-	/* decode the BCD segments into the time */
-	decoded.tm_year = 100+(segment[0]*10)+segment[1];
-	decoded.tm_mon = (segment[2]*10)+segment[3]-1;
-	decoded.tm_mday = (segment[4]*10)+segment[5];
-	decoded.tm_wday = segment[6];
-	decoded.tm_hour = (segment[7]*10)+segment[8];
-	decoded.tm_min = (segment[9]*10)+segment[10];
-	decoded.tm_sec = 0;
-	decoded.tm_isdst = 0;
+	/* decode the BCD digits into the time */
+	DecodeBCD(a, digits, sizeof(digits)/sizeof(digits[0]), MSF_OFFSET,
+		1, field);
+	memset(&decoded, 0, sizeof(decoded));
+	decoded.tm_year = 100+field[FIELD_YEAR];
+	decoded.tm_mon = field[FIELD_MON]-1;
+	decoded.tm_mday = field[FIELD_MDAY];
+	decoded.tm_wday = field[FIELD_WDAY];
+	decoded.tm_hour = field[FIELD_HOUR];
+	decoded.tm_min = field[FIELD_MIN];
 
 	/* some extra sanity checks */
 	if ((decoded.tm_min>59) || (decoded.tm_hour>23) ||
 			(decoded.tm_wday>6) || (decoded.tm_mday>31) ||
 			(decoded.tm_mon>11) ||(decoded.tm_year>199))
-		return -1;
+		return DECODE_RANGE;
 
 	/* return adjusted for daylight savings */
-	return (UTCtime(&decoded)-((code[length-3]==2) ? 3600 : 0));
+	return (UTCtime(&decoded)-((b & SECOND(58, MSF_OFFSET)) ? 3600 : 0));
 }
 
 
 /*
- * Decode the WWVB signal. Return time since epoc on success, -1 on error.
+ * Decode the WWVB signal. Return time since epoc on success, DECODE_FORMAT,
+ * DECODE_PARITY or DECODE_RANGE on error.
  */
-time_t DecodeWWVB(char *code, int length)
+time_t DecodeWWVB(struct frameBits *f)
 {
-	int bcd[] = { 3,1,4,3,2,1,4,3,2,1,4,1,4,11,4,1,4 };
+	static const struct bcdDigit digits[] = {
+		{ 1, 3, FIELD_MIN, 10 }, { 5, 4, FIELD_MIN, 1 },
+		{ 12, 2, FIELD_HOUR, 10 }, { 15, 4, FIELD_HOUR, 1 },
+		{ 22, 2, FIELD_YDAY, 100 }, { 25, 4, FIELD_YDAY, 10 },
+		{ 30, 4, FIELD_YDAY, 1 },
+		{ 45, 4, FIELD_YEAR, 10 }, { 50, 4, FIELD_YEAR, 1 }
+	};
+	static const uint64_t markers = SECOND(9, WWVB_OFFSET) |
+		SECOND(19, WWVB_OFFSET) | SECOND(29, WWVB_OFFSET) |
+		SECOND(39, WWVB_OFFSET) | SECOND(49, WWVB_OFFSET);
+	static const uint64_t data = SECONDS(1, 58, WWVB_OFFSET) &
+		~(SECOND(9, WWVB_OFFSET) | SECOND(19, WWVB_OFFSET) |
+		SECOND(29, WWVB_OFFSET) | SECOND(39, WWVB_OFFSET) |
+		SECOND(49, WWVB_OFFSET));
 	int months[] = { 0,31,59,90,120,151,181,212,243,273,304,334 };
-	int segment[17];
-	int i,j,k,sum;
+	int i,yday,leap,field[FIELDS];
+	uint64_t used;
 	struct tm decoded;
 
 
-	/* check framing markers exist and data pulses are of correct type */
-	for (i=2;i<60;i++) {
-		j = code[length-i-1];
-		k = (i-1)%10;
-		if ((k==0) && (j!=5))
-			return -1;
-		else if ((k!=0) && (j!=1) && (j!=4))
-			return -1;
-	}
-
-	/* calculate all the individual BCD segments */
-	k = length-60;
-	for(i=0;i<17;i++) {
-		sum = 0;
-		for(j=0;j<bcd[i];j++,k++)
-			sum += ((code[k]==4) ? 1 : 0) << (bcd[i]-j-1);
-		segment[i] = sum;
-	}
-
-	/* decode the BCD segments into the time */
-	decoded.tm_year = 100+segment[16]+(segment[14]*10);
-	decoded.tm_yday = segment[12]+(segment[10]*10)+(segment[8]*100)-1;
-	decoded.tm_hour = segment[6]+(segment[4]*10);
-	decoded.tm_min = segment[2]+(segment[0]*10);
-	decoded.tm_sec = 0;
-	decoded.tm_isdst = 0;
+	/* check framing markers are 800ms and data pulses 200ms or 500ms,
+	   allowing for erased seconds */
+	if ((((f->d | f->e) & markers)!=markers) || (f->d & data) ||
+			(((f->a | f->e) & data)!=data) || ((f->b ^ f->c) & data))
+		return DECODE_FORMAT;
+
+	/* there is no parity, so none of the bits used can be erased */
+	used = SECOND(55, WWVB_OFFSET);
+	for (i=0;i<(int) (sizeof(digits)/sizeof(digits[0]));i++)
+		used |= SECONDS(digits[i].second, digits[i].width, WWVB_OFFSET);
+	if (f->e & used)
+		return DECODE_FORMAT;
+
+	/* decode the BCD digits into the time, a one being 500ms */
+	DecodeBCD(f->c, digits, sizeof(digits)/sizeof(digits[0]), WWVB_OFFSET,
+		1, field);
+	memset(&decoded, 0, sizeof(decoded));
+	decoded.tm_year = 100+field[FIELD_YEAR];
+	decoded.tm_yday = field[FIELD_YDAY]-1;
+	decoded.tm_hour = field[FIELD_HOUR];
+	decoded.tm_min = field[FIELD_MIN];
+	leap = (f->c & SECOND(55, WWVB_OFFSET)) ? 1 : 0;
 
 	/* some extra sanity checks */
 	if ((decoded.tm_min>59) || (decoded.tm_hour>23) ||
 			(decoded.tm_yday>365) || (decoded.tm_year>199))
-		return -1;
+		return DECODE_RANGE;
+
+	/* in leap years day 59 is the 29th of February, and the days after it
+	   are one later in the table of month starts */
+	yday = decoded.tm_yday;
+	if ((leap==1) && (yday>59))
+		yday--;
 
 	/* set the month and day of month fields */
 	decoded.tm_mon = -1;
 	for (i=11;i>=0;i--) {
-		if (months[i]<=decoded.tm_yday) {
+		if (months[i]<=yday) {
 			decoded.tm_mon = i;
-			decoded.tm_mday = 1+decoded.tm_yday-months[i];
+			decoded.tm_mday = 1+yday-months[i];
 			break;
 		}
 	}
-
-	/* adjust for leap years */
-	if (code[length-6]==4) {
-		if (decoded.tm_yday>59) {
-			decoded.tm_mday--;
-		} else if (decoded.tm_yday==59) {	
-			decoded.tm_mon = 1;
-			decoded.tm_mday = 29;
-		}
+	if ((leap==1) && (decoded.tm_yday==59)) {
+		decoded.tm_mon = 1;
+		decoded.tm_mday = 29;
 	}
 	if (decoded.tm_mon==-1)
-		return -1;
+		return DECODE_RANGE;
 
 	/* WWVB transmits the time for the minute just gone so adjust */
 	return (UTCtime(&decoded)+60);
@@ -434,43 +1346,323 @@ time_t DecodeWWVB(char *code, int length)
 
 
 /*
- * Print the pulse information
+ * Return 00:00 UTC on the n'th Sunday of a month, or the last Sunday if n
+ * is zero
  */
-void PrintPulseInfo(struct clockInfo *c)
+time_t NthSunday(int year, int month, int n)
 {
-	struct timeval tv;
-
-	timersub(&c->end, &c->start, &tv);
-	fprintf(stdout, "%s: %3d %4d %9d   ", c->line, c->count,
-		c->code[c->count-1], (int) tv.tv_usec);
+	struct tm tm;
+	time_t t;
+	int mday;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = year;
+	tm.tm_mon = month;
+	if (n==0) {
+		/* the last day of the month, and back to Sunday */
+		tm.tm_mon++;
+		tm.tm_mday = 0;
+		t = timegm(&tm);
+		gmtime_r(&t, &tm);
+		mday = tm.tm_mday-tm.tm_wday;
+	} else {
+		tm.tm_mday = 1;
+		t = timegm(&tm);
+		gmtime_r(&t, &tm);
+		mday = 1+((7-tm.tm_wday)%7)+(7*(n-1));
+	}
+	tm.tm_mday = mday;
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
 
-	return;
+	return timegm(&tm);
 }
 
 
 /*
- * Log a warning if no signal has been received in the last 5 minutes
+ * Is European summer time in effect, from 01:00 UTC on the last Sunday in
+ * March till 01:00 UTC on the last Sunday in October
  */
-void LogNoSignalWarning(struct clockInfo *c, time_t now)
+int EUSummerTime(time_t t)
 {
-	if (((now-c->last)>300) && (c->last>-1) && (c->error==0)) {
-		c->error++;
-		syslog(LOG_INFO, "no valid time received in last five minutes "
-			"for %s line", c->line);
-	}
+	struct tm tm;
 
-	return;
+	gmtime_r(&t, &tm);
+
+	return ((t>=NthSunday(tm.tm_year, 2, 0)+3600) &&
+		(t<NthSunday(tm.tm_year, 9, 0)+3600));
 }
 
 
 /*
- * Attach the shared memory segment for the reference clock driver
+ * Is US daylight saving time in effect, from 02:00 Eastern on the second
+ * Sunday in March till 02:00 Eastern on the first Sunday in November
  */
-struct shmTime *AttachSharedMemory(int unit, int *shmid)
+int USSummerTime(time_t t)
 {
-	struct shmTime *shm;
+	struct tm tm;
 
-	*shmid = shmget(SHMKEY+unit, sizeof(struct shmTime), IPC_CREAT | 0700);
+	gmtime_r(&t, &tm);
+
+	return ((t>=NthSunday(tm.tm_year, 2, 2)+(7*3600)) &&
+		(t<NthSunday(tm.tm_year, 10, 1)+(6*3600)));
+}
+
+
+/*
+ * Place a BCD digit of n bits into a time code, either least or most
+ * significant bit first. Returns the number of bits set for the parity.
+ */
+int PutBCD(char *bits, int pos, int value, int n, int msbfirst)
+{
+	int i,bit,sum;
+
+	for (i=0,sum=0;i<n;i++) {
+		bit = (msbfirst==1) ? (value>>(n-i-1)) & 1 : (value>>i) & 1;
+		bits[pos+i] = bit;
+		sum += bit;
+	}
+
+	return sum;
+}
+
+
+/*
+ * Encode a minute of the DCF77 signal starting at t, which announces the
+ * CET/CEST time of the following minute, as the pulse type of each second
+ */
+void EncodeDCF77(struct generator *g, time_t t, int *symbol)
+{
+	char bits[60] = { 0 };
+	struct tm tm;
+	time_t local;
+	int i,summer,sum;
+
+	t += 60;
+	summer = EUSummerTime(t);
+	local = t+((summer==1) ? 7200 : 3600);
+	gmtime_r(&local, &tm);
+
+	bits[16] = (EUSummerTime(t+3600)!=summer);
+	bits[17] = summer;
+	bits[18] = !summer;
+	bits[20] = 1;
+	sum = PutBCD(bits, 21, tm.tm_min%10, 4, 0);
+	sum += PutBCD(bits, 25, tm.tm_min/10, 3, 0);
+	bits[28] = sum%2;
+	sum = PutBCD(bits, 29, tm.tm_hour%10, 4, 0);
+	sum += PutBCD(bits, 33, tm.tm_hour/10, 2, 0);
+	bits[35] = sum%2;
+	sum = PutBCD(bits, 36, tm.tm_mday%10, 4, 0);
+	sum += PutBCD(bits, 40, tm.tm_mday/10, 2, 0);
+	sum += PutBCD(bits, 42, (tm.tm_wday==0) ? 7 : tm.tm_wday, 3, 0);
+	sum += PutBCD(bits, 45, (tm.tm_mon+1)%10, 4, 0);
+	sum += PutBCD(bits, 49, (tm.tm_mon+1)/10, 1, 0);
+	sum += PutBCD(bits, 50, tm.tm_year%10, 4, 0);
+	sum += PutBCD(bits, 54, (tm.tm_year/10)%10, 4, 0);
+	bits[58] = sum%2;
+
+	for (i=0;i<59;i++)
+		symbol[i] = (bits[i]==1) ? SYMBOL_200 : SYMBOL_100;
+	symbol[59] = SYMBOL_NONE;
+
+	return;
+}
+
+
+/*
+ * Encode a minute of the MSF signal starting at t, which announces the
+ * GMT/BST time of the following minute, as the pulse type of each second
+ */
+void EncodeMSF(struct generator *g, time_t t, int *symbol)
+{
+	char a[60] = { 0 };
+	char b[60] = { 0 };
+	struct tm tm;
+	time_t local;
+	int i,summer;
+
+	t += 60;
+	summer = EUSummerTime(t);
+	local = t+((summer==1) ? 3600 : 0);
+	gmtime_r(&local, &tm);
+
+	/* DUT1 in tenths of a second on bits 1-8 and 9-16 */
+	for (i=0;(i<abs(g->dut1)) && (i<8);i++)
+		b[((g->dut1>0) ? 1 : 9)+i] = 1;
+
+	b[54] = !((PutBCD(a, 17, (tm.tm_year/10)%10, 4, 1) +
+		PutBCD(a, 21, tm.tm_year%10, 4, 1))%2);
+	b[55] = !((PutBCD(a, 25, (tm.tm_mon+1)/10, 1, 1) +
+		PutBCD(a, 26, (tm.tm_mon+1)%10, 4, 1) +
+		PutBCD(a, 30, tm.tm_mday/10, 2, 1) +
+		PutBCD(a, 32, tm.tm_mday%10, 4, 1))%2);
+	b[56] = !(PutBCD(a, 36, tm.tm_wday, 3, 1)%2);
+	b[57] = !((PutBCD(a, 39, tm.tm_hour/10, 2, 1) +
+		PutBCD(a, 41, tm.tm_hour%10, 4, 1) +
+		PutBCD(a, 45, tm.tm_min/10, 3, 1) +
+		PutBCD(a, 48, tm.tm_min%10, 4, 1))%2);
+	for (i=53;i<59;i++)
+		a[i] = 1;
+	b[53] = (EUSummerTime(t+3600)!=summer);
+	b[58] = summer;
+
+	symbol[0] = SYMBOL_500;
+	for (i=1;i<60;i++) {
+		if (a[i]==0)
+			symbol[i] = (b[i]==0) ? SYMBOL_100 : SYMBOL_B;
+		else
+			symbol[i] = (b[i]==0) ? SYMBOL_200 : SYMBOL_300;
+	}
+
+	return;
+}
+
+
+/*
+ * Encode a minute of the WWVB signal starting at t, which carries the UTC
+ * time of the start of that minute, as the pulse type of each second
+ */
+void EncodeWWVB(struct generator *g, time_t t, int *symbol)
+{
+	char bits[60] = { 0 };
+	struct tm tm;
+	time_t midnight;
+	int i,year;
+
+	gmtime_r(&t, &tm);
+	year = tm.tm_year+1900;
+	midnight = t-(tm.tm_hour*3600)-(tm.tm_min*60)-tm.tm_sec;
+
+	PutBCD(bits, 1, tm.tm_min/10, 3, 1);
+	PutBCD(bits, 5, tm.tm_min%10, 4, 1);
+	PutBCD(bits, 12, tm.tm_hour/10, 2, 1);
+	PutBCD(bits, 15, tm.tm_hour%10, 4, 1);
+	PutBCD(bits, 22, (tm.tm_yday+1)/100, 2, 1);
+	PutBCD(bits, 25, ((tm.tm_yday+1)/10)%10, 4, 1);
+	PutBCD(bits, 30, (tm.tm_yday+1)%10, 4, 1);
+	PutBCD(bits, 45, (tm.tm_year/10)%10, 4, 1);
+	PutBCD(bits, 50, tm.tm_year%10, 4, 1);
+	bits[55] = ((year%4==0) && ((year%100!=0) || (year%400==0)));
+	bits[57] = USSummerTime(midnight+86400);
+	bits[58] = USSummerTime(midnight);
+
+	for (i=0;i<60;i++) {
+		if ((i%10==9) || (i==0))
+			symbol[i] = SYMBOL_800;
+		else
+			symbol[i] = (bits[i]==1) ? SYMBOL_500 : SYMBOL_200;
+	}
+
+	return;
+}
+
+
+/*
+ * Subtract two timespec values, the timespec equivalent of timersub()
+ */
+void TimeSpecSub(struct timespec *a, struct timespec *b,
+	struct timespec *result)
+{
+	result->tv_sec = a->tv_sec-b->tv_sec;
+	result->tv_nsec = a->tv_nsec-b->tv_nsec;
+	if (result->tv_nsec<0) {
+		result->tv_sec--;
+		result->tv_nsec += 1000000000;
+	}
+
+	return;
+}
+
+
+/*
+ * Add a number of nanoseconds to a timespec
+ */
+void TimeSpecAdd(struct timespec *ts, long nsec)
+{
+	ts->tv_sec += nsec/1000000000;
+	ts->tv_nsec += nsec%1000000000;
+	if (ts->tv_nsec>=1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	} else if (ts->tv_nsec<0) {
+		ts->tv_sec--;
+		ts->tv_nsec += 1000000000;
+	}
+
+	return;
+}
+
+
+/*
+ * Print the pulse information
+ */
+void PrintPulseInfo(struct clockInfo *c)
+{
+	struct timespec ts;
+
+	TimeSpecSub(&c->end, &c->start, &ts);
+	fprintf(stdout, "%s: %3d %4d %9ld   ", c->line, c->count,
+		FrameSymbol(&c->bits, 0), (long) ts.tv_nsec);
+
+	return;
+}
+
+
+/*
+ * Log a warning if no signal has been received in the last 5 minutes
+ */
+void LogNoSignalWarning(struct clockInfo *c, time_t now)
+{
+	if (((now-c->last)>300) && (c->last>-1) && (c->error==0)) {
+		c->error++;
+		syslog(LOG_INFO, "no valid time received in last five minutes "
+			"for %s line", c->line);
+	}
+
+	return;
+}
+
+
+/*
+ * Set up the ring of samples in an extended SHM segment, unless a previous
+ * run already did, in which case the head carries on from where it was so a
+ * reader does not take new samples for ones it has seen
+ */
+void InitRing(struct shmRing *ring)
+{
+	if ((ring->magic==SHM_RING_MAGIC) && (ring->version==SHM_RING_VERSION)
+			&& (ring->size==SHM_SAMPLES))
+		return;
+
+	__atomic_store_n(&ring->magic, 0, __ATOMIC_SEQ_CST);
+	memset(ring->sample, 0, sizeof(ring->sample));
+	ring->version = SHM_RING_VERSION;
+	ring->size = SHM_SAMPLES;
+	ring->head = 0;
+	__atomic_store_n(&ring->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+	return;
+}
+
+
+/*
+ * Attach the shared memory segment for the reference clock driver. The
+ * extended segment with the ring of samples is used if possible, but one
+ * already created by a reader that only knows the original structure is too
+ * small for it and is used as it is, with the ring left NULL.
+ */
+struct shmTime *AttachSharedMemory(int unit, int *shmid, struct shmRing **ring)
+{
+	struct shmTime *shm;
+	size_t size;
+
+	*ring = NULL;
+	size = sizeof(struct shmRing);
+	*shmid = shmget(SHMKEY+unit, size, IPC_CREAT | 0700);
+	if (*shmid==-1) {
+		size = sizeof(struct shmTime);
+		*shmid = shmget(SHMKEY+unit, size, IPC_CREAT | 0700);
+	}
 	if (*shmid==-1)
 		return NULL;
 
@@ -478,406 +1670,4365 @@ struct shmTime *AttachSharedMemory(int unit, int *shmid)
 	if ((shm==(void *) -1) || (shm==0))
 		return NULL;
 
+	if (size==sizeof(struct shmRing)) {
+		*ring = (struct shmRing *) shm;
+		InitRing(*ring);
+	}
+
 	return shm;
 }
 
 
 /*
- * Set the DTR and RTS line to power the device(s) on.
+ * Create the statistics segment and copy the statistics of every line into
+ * it, so radioclkstat can read them without disturbing us. A segment left by
+ * an older version with a different layout is removed first.
+ */
+int AttachStatistics(void)
+{
+	struct statsSegment *seg;
+	struct clockInfo *c;
+	int i,j,shmid;
+
+	shmid = shmget(STATS_KEY, sizeof(struct statsSegment), IPC_CREAT | 0644);
+	if ((shmid==-1) && (errno==EINVAL)) {
+		shmid = shmget(STATS_KEY, 0, 0);
+		if (shmid!=-1)
+			shmctl(shmid, IPC_RMID, NULL);
+		shmid = shmget(STATS_KEY, sizeof(struct statsSegment),
+			IPC_CREAT | 0644);
+	}
+	if (shmid==-1)
+		return -1;
+
+	seg = (struct statsSegment *) shmat(shmid, 0, 0);
+	if ((seg==(void *) -1) || (seg==0))
+		return -1;
+
+	__atomic_store_n(&seg->magic, 0, __ATOMIC_SEQ_CST);
+	memset(seg->line, 0, sizeof(seg->line));
+	seg->version = STATS_VERSION;
+	seg->size = sizeof(struct statsSegment);
+	seg->lines = nports*3;
+	seg->started = time(NULL);
+	for (i=0;i<nports;i++) {
+		for (j=0;j<3;j++) {
+			c = &ports[i].line[j];
+			seg->line[(i*3)+j] = c->ownStats;
+			c->shared = &seg->line[(i*3)+j];
+		}
+	}
+	__atomic_store_n(&seg->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+	statistics = seg;
+
+	return 0;
+}
+
+
+/*
+ * Mark the statistics of a line as being updated, and as done
+ */
+static inline void StatsBegin(struct lineStats *st)
+{
+	__atomic_store_n(&st->seq, st->seq+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void StatsEnd(struct lineStats *st)
+{
+	__atomic_store_n(&st->seq, st->seq+1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Copy the statistics of a line into the statistics segment. They are kept
+ * by the line and only copied once it is done with an edge, so the sequence
+ * lock is held just for the copy and not while the edge is decoded.
+ */
+static inline void StatsPublish(struct clockInfo *c)
+{
+	if (c->shared==NULL)
+		return;
+
+	StatsBegin(c->shared);
+	memcpy(&c->shared->unit, &c->stats->unit, sizeof(struct lineStats)-
+		offsetof(struct lineStats, unit));
+	StatsEnd(c->shared);
+
+	return;
+}
+
+
+/*
+ * Index into the statistics of a protocol, -1 if it is not known
+ */
+static inline int StatsProtocol(int radio)
+{
+	switch (radio) {
+		case DCF77:
+			return STATS_DCF77;
+		case MSF:
+			return STATS_MSF;
+		case WWVB:
+			return STATS_WWVB;
+	}
+
+	return -1;
+}
+
+
+/*
+ * Set the DTR and RTS line to power the device(s) on.
+ */
+int TurnReceiverOn(int fd)
+{
+	int arg;
+
+	if (ioctl(fd, TIOCMGET, &arg)!=0)
+		return -1;
+	arg |= (TIOCM_DTR | TIOCM_RTS);
+	if (ioctl(fd, TIOCMSET, &arg)!=0)
+		return -1;
+
+	return 0;
+}
+
+
+/*
+ * Find the /dev/ppsN device the kernel created for the serial port
+ */
+int FindPPSDevice(char *devname, char *ppsname, int length)
+{
+	int i;
+	FILE *str;
+	char path[64],tty[64];
+
+	for (i=0;i<PPS_MAX_SOURCES;i++) {
+		snprintf(path, sizeof(path), "/sys/class/pps/pps%d/path", i);
+		if (!(str = fopen(path, "r")))
+			continue;
+		if (fgets(tty, sizeof(tty), str)==NULL)
+			tty[0] = '\0';
+		fclose(str);
+		tty[strcspn(tty, "\n")] = '\0';
+		if (!strcmp(tty, devname)) {
+			snprintf(ppsname, length, "/dev/pps%d", i);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * Attach the PPS line discipline to the serial port and set up the kernel
+ * to time stamp both edges of the DCD line.
+ */
+int OpenPPS(struct clockInfo *c, int fd, char *devname)
+{
+	int ldisc,mode;
+	pps_params_t params;
+	pps_info_t info;
+	struct timespec timeout = { 0, 0 };
+	char ppsname[32];
+
+	c->ppsfd = -1;
+	ldisc = N_PPS;
+	if (ioctl(fd, TIOCSETD, &ldisc)!=0)
+		return -1;
+
+	if (FindPPSDevice(devname, ppsname, sizeof(ppsname))!=0)
+		goto failed;
+	if ((c->ppsfd = open(ppsname, O_RDWR))<0)
+		goto failed;
+
+	if ((time_pps_create(c->ppsfd, &c->pps)!=0) ||
+			(time_pps_getcap(c->pps, &mode)!=0) ||
+			((mode & PPS_CAPTUREBOTH)!=PPS_CAPTUREBOTH) ||
+			(time_pps_getparams(c->pps, &params)!=0))
+		goto failed;
+
+	params.mode = PPS_CAPTUREBOTH | PPS_TSFMT_TSPEC;
+	if ((time_pps_setparams(c->pps, &params)!=0) ||
+	    (time_pps_fetch(c->pps, PPS_TSFMT_TSPEC, &info, &timeout)!=0))
+		goto failed;
+	c->assert = info.assert_sequence;
+	c->clear = info.clear_sequence;
+
+	return 0;
+
+	/* put the serial port back as it was, the PPS handle being no more
+	   than the file descriptor */
+failed:
+	if (c->ppsfd>=0) {
+		close(c->ppsfd);
+		c->ppsfd = -1;
+	}
+	ldisc = N_TTY;
+	ioctl(fd, TIOCSETD, &ldisc);
+
+	return -1;
+}
+
+
+/*
+ * Detach the PPS line discipline from the serial port
+ */
+void ClosePPS(struct clockInfo *c, int fd)
+{
+	int ldisc;
+
+	if (c->ppsfd<0)
+		return;
+
+	time_pps_destroy(c->pps);
+	close(c->ppsfd);
+	c->ppsfd = -1;
+	ldisc = N_TTY;
+	ioctl(fd, TIOCSETD, &ldisc);
+
+	return;
+}
+
+
+/*
+ * Replace the user space time stamp of an edge with the time stamp captured
+ * by the kernel, if the kernel has seen a new event for it. Only called for
+ * lines that changed state.
+ */
+int FetchPPSTimeStamp(struct clockInfo *c, int arg, struct timespec *ts,
+	struct timespec *edge)
+{
+	pps_info_t info;
+	struct timespec timeout = { 0, 0 };
+
+	*edge = *ts;
+
+	if (c->ppsfd<0)
+		return 0;
+
+	if (time_pps_fetch(c->pps, PPS_TSFMT_TSPEC, &info, &timeout)!=0)
+		return 1;
+
+	if ((arg) && (info.assert_sequence!=c->assert)) {
+		c->assert = info.assert_sequence;
+		*edge = info.assert_timestamp;
+	} else if ((!arg) && (info.clear_sequence!=c->clear)) {
+		c->clear = info.clear_sequence;
+		*edge = info.clear_timestamp;
+	}
+
+	return 1;
+}
+
+
+/*
+ * Handler for the signal used to wake a capture thread out of TIOCMIWAIT.
+ * It is installed without SA_RESTART, so the ioctl simply returns EINTR.
+ */
+void SerialTimeoutAlarm(int sig)
+{
+	return;
+}
+
+
+/*
+ * Signed distance in nanoseconds from the expected phase to a point in the
+ * second, wrapped into the range -0.5s to +0.5s
+ */
+long PhaseError(long phase, long nsec)
+{
+	long err;
+
+	err = nsec-phase;
+	if (err>500000000)
+		err -= 1000000000;
+	else if (err<=-500000000)
+		err += 1000000000;
+
+	return err;
+}
+
+
+/*
+ * Half width of the fine polling window around the expected pulse start
+ */
+long PhaseWindow(struct pollPhase *ph)
+{
+	long window;
+
+	window = 4*ph->spread;
+	if (window<POLL_WINDOW_MIN)
+		window = POLL_WINDOW_MIN;
+	else if (window>POLL_WINDOW_MAX)
+		window = POLL_WINDOW_MAX;
+
+	return window;
+}
+
+
+/*
+ * Learn the phase of the start of the pulses on a line from the (falling)
+ * edges seen on it
+ */
+void UpdatePhase(struct pollPhase *ph, struct timespec *edge)
+{
+	long err;
+
+	err = PhaseError(ph->phase, edge->tv_nsec);
+
+	if (ph->locked==0) {
+		if ((ph->hits>0) && (labs(err)<=POLL_CAPTURE)) {
+			ph->phase += err/2;
+			ph->hits++;
+		} else {
+			ph->phase = edge->tv_nsec;
+			ph->spread = POLL_COARSE/2;
+			ph->hits = 1;
+		}
+		if (ph->hits>=POLL_LOCK) {
+			ph->locked = 1;
+			ph->seen = edge->tv_sec;
+		}
+	} else if (labs(err)<=PhaseWindow(ph)) {
+		ph->phase += err/8;
+		ph->spread += (labs(err)-ph->spread)/8;
+		ph->seen = edge->tv_sec;
+	}
+
+	/* wrap the phase back into the second */
+	if (ph->phase<0)
+		ph->phase += 1000000000;
+	else if (ph->phase>=1000000000)
+		ph->phase -= 1000000000;
+
+	return;
+}
+
+
+/*
+ * Work out when to take the next sample of the serial port, which is the
+ * sooner of the next background poll and the next fine poll in the window
+ * around the expected start of a pulse.
+ */
+void NextPollTime(struct portInfo *p, struct timespec *next)
+{
+	int i;
+	long step,err,window,wait;
+	struct pollPhase *ph;
+
+	step = POLL_COARSE;
+	for (i=0;i<3;i++) {
+		ph = &p->phase[i];
+		if (ph->locked==0)
+			continue;
+
+		/* drop the lock if the pulses have stopped arriving on time */
+		if ((p->sample.tv_sec-ph->seen)>POLL_UNLOCK) {
+			ph->locked = 0;
+			ph->hits = 0;
+			continue;
+		}
+		if (step==POLL_COARSE)
+			step = POLL_BACKGROUND;
+
+		/* poll finely inside the window, else sleep till it opens */
+		window = PhaseWindow(ph);
+		err = PhaseError(ph->phase, p->sample.tv_nsec);
+		if (labs(err)<window) {
+			wait = POLL_FINE;
+		} else {
+			wait = -window-err;
+			if (wait<=0)
+				wait += 1000000000;
+		}
+		if (wait<step)
+			step = wait;
+	}
+
+	*next = p->sample;
+	TimeSpecAdd(next, step);
+
+	return;
+}
+
+
+/*
+ * Add to a counter of a port that only the thread calling writes, so the
+ * main thread reading it meanwhile sees either the old or the new count
+ */
+static inline void CountAdd(unsigned long *n, unsigned long k)
+{
+	__atomic_store_n(n, __atomic_load_n(n, __ATOMIC_RELAXED)+k,
+		__ATOMIC_RELAXED);
+}
+
+static inline unsigned long CountGet(unsigned long *n)
+{
+	return __atomic_load_n(n, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Tell a failed ioctl on a serial port interrupted by the watchdog, which is
+ * a time out, from the port itself failing, as when a USB adapter is pulled
+ */
+static inline int SerialError(void)
+{
+	return (errno==EINTR) ? -1 : SERIAL_FAILED;
+}
+
+
+/*
+ * Poll the serial port till either the DCD, CTS or DSR line changes status.
+ * The time of the change is interpolated between the samples either side.
+ * Returns -1 on a time out, or SERIAL_FAILED if the port cannot be read.
+ */
+int PollSerialChange(struct portInfo *p, struct timespec *ts)
+{
+	int i,arg;
+	struct timespec next,now,diff;
+	time_t start;
+
+
+	/* take the first sample */
+	if (p->state==-1) {
+		CountAdd(&p->counters.gets, 1);
+		if (ioctl(p->fd, TIOCMGET, &p->state)!=0) {
+			p->state = -1;
+			return SerialError();
+		}
+		clock_gettime(CLOCK_REALTIME, &p->sample);
+	}
+
+	start = p->sample.tv_sec;
+	while ((p->sample.tv_sec-start)<SERIAL_TIMEOUT) {
+		NextPollTime(p, &next);
+		CountAdd(&p->counters.sleeps, 1);
+		clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next, NULL);
+		CountAdd(&p->counters.gets, 1);
+		if (ioctl(p->fd, TIOCMGET, &arg)!=0)
+			return SerialError();
+		clock_gettime(CLOCK_REALTIME, &now);
+
+		if (((arg ^ p->state) & (TIOCM_CD | TIOCM_CTS | TIOCM_DSR))==0) {
+			p->sample = now;
+			continue;
+		}
+
+		/* the edge is half way between this sample and the last */
+		TimeSpecSub(&now, &p->sample, &diff);
+		*ts = p->sample;
+		TimeSpecAdd(ts, ((diff.tv_sec*1000000000)+diff.tv_nsec)/2);
+
+		/* learn the phase of the pulse starts, which are falling edges */
+		for (i=0;i<3;i++) {
+			if ((p->state & lineMask[i]) && !(arg & lineMask[i]))
+				UpdatePhase(&p->phase[i], ts);
+		}
+
+		p->sample = now;
+		p->state = arg;
+		return arg;
+	}
+
+	/* nothing changed for 10 seconds return with error */
+	return -1;
+}
+
+
+/*
+ * Time in ns from the monotonic clock, for measuring latencies
+ */
+static inline uint64_t MonotonicNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec*1000000000)+ts.tv_nsec;
+}
+
+
+/*
+ * Add a latency in ns to a histogram
+ */
+void HistAdd(struct latencyHist *h, uint64_t ns)
+{
+	int octave,i;
+
+	if (ns<HIST_SUB) {
+		i = ns;
+	} else {
+		octave = 63-__builtin_clzll(ns);
+		i = (octave-1)*HIST_SUB+((ns>>(octave-2)) & (HIST_SUB-1));
+		if (i>=HIST_BUCKETS)
+			i = HIST_BUCKETS-1;
+	}
+	h->bucket[i]++;
+	h->count++;
+	h->sum += ns;
+	if (ns>h->max)
+		h->max = ns;
+
+	return;
+}
+
+
+/*
+ * Smallest latency in ns that falls in a bucket of a histogram
+ */
+uint64_t HistLow(int i)
+{
+	if (i<HIST_SUB)
+		return i;
+
+	return (uint64_t) (HIST_SUB+(i%HIST_SUB))<<(i/HIST_SUB-1);
+}
+
+
+/*
+ * Latency in ns that the given fraction of those in a histogram were no more
+ * than, to the top of the bucket it falls in
+ */
+uint64_t HistPercentile(struct latencyHist *h, double fraction)
+{
+	uint64_t seen,wanted;
+	int i;
+
+	wanted = ceil(h->count*fraction);
+	for (i=0,seen=0;i<HIST_BUCKETS-1;i++) {
+		seen += h->bucket[i];
+		if ((seen>=wanted) && (seen>0))
+			return (HistLow(i+1)-1<h->max) ? HistLow(i+1)-1 : h->max;
+	}
+
+	return h->max;
+}
+
+
+/*
+ * Log a summary of a latency histogram
+ */
+void LogLatency(const char *name, const char *stage, struct latencyHist *h)
+{
+	if (h->count==0)
+		return;
+
+	if (test==0)
+		syslog(LOG_INFO, "%s: %s latency %llu samples mean %.1fus "
+			"50%% %.1fus 99%% %.1fus 99.9%% %.1fus max %.1fus",
+			name, stage, (unsigned long long) h->count,
+			h->sum/1e3/h->count, HistPercentile(h, 0.5)/1e3,
+			HistPercentile(h, 0.99)/1e3,
+			HistPercentile(h, 0.999)/1e3, h->max/1e3);
+	else
+		fprintf(stderr, "radioclkd: %s: %s latency %llu samples mean "
+			"%.1fus 50%% %.1fus 99%% %.1fus 99.9%% %.1fus max "
+			"%.1fus\n", name, stage,
+			(unsigned long long) h->count, h->sum/1e3/h->count,
+			HistPercentile(h, 0.5)/1e3,
+			HistPercentile(h, 0.99)/1e3,
+			HistPercentile(h, 0.999)/1e3, h->max/1e3);
+
+	return;
+}
+
+
+/*
+ * Write a latency histogram to a file, a summary line followed by the range
+ * in ns and count of each bucket that is not empty
+ */
+void WriteHist(FILE *str, const char *name, const char *stage,
+	struct latencyHist *h)
+{
+	int i;
+
+	fprintf(str, "%s %s count %llu mean %.0f p50 %llu p99 %llu p999 %llu "
+		"max %llu\n", name, stage, (unsigned long long) h->count,
+		(h->count>0) ? (double) h->sum/h->count : 0.0,
+		(unsigned long long) HistPercentile(h, 0.5),
+		(unsigned long long) HistPercentile(h, 0.99),
+		(unsigned long long) HistPercentile(h, 0.999),
+		(unsigned long long) h->max);
+	for (i=0;i<HIST_BUCKETS;i++) {
+		if (h->bucket[i]==0)
+			continue;
+		fprintf(str, "%s %s bucket %llu %llu %llu\n", name, stage,
+			(unsigned long long) HistLow(i),
+			(unsigned long long) HistLow(i+1)-1,
+			(unsigned long long) h->bucket[i]);
+	}
+
+	return;
+}
+
+
+/*
+ * Write all the latency histograms to the file given with -L, replacing the
+ * previous dump in one go so a reader never sees half of one
+ */
+int WriteLatencyFile(void)
+{
+	char path[256];
+	FILE *str;
+	int i,j;
+
+	snprintf(path, sizeof(path), "%s.tmp", latencyFile);
+	if (!(str = fopen(path, "w")))
+		return -1;
+
+	fprintf(str, "# radioclkd latency histograms in ns at %ld\n",
+		(long) time(NULL));
+	for (i=0;i<nports;i++)
+		for (j=0;j<LATENCY_STAGES;j++)
+			WriteHist(str, ports[i].name, latencyName[j],
+				&ports[i].latency[j]);
+	if (probeCPU>=0)
+		WriteHist(str, "probe", "wakeup", &probeLatency);
+
+	if ((fclose(str)!=0) || (rename(path, latencyFile)!=0)) {
+		unlink(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Wake up latency probe in the manner of cyclictest, a real time thread
+ * bound to a CPU that sleeps till an absolute time every PROBE_INTERVAL and
+ * measures how late it was woken, loops until we die
+ */
+void *ProbeLatency(void *data)
+{
+	struct timespec next,now;
+	cpu_set_t set;
+	long late;
+
+	CPU_ZERO(&set);
+	CPU_SET(probeCPU, &set);
+	if (sched_setaffinity(0, sizeof(set), &set)!=0) {
+		if (test==0)
+			syslog(LOG_INFO, "unable to bind the latency probe to "
+				"cpu %d", probeCPU);
+		else
+			fprintf(stderr, "radioclkd: unable to bind the latency "
+				"probe to cpu %d\n", probeCPU);
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (;;) {
+		TimeSpecAdd(&next, PROBE_INTERVAL);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+				NULL)==EINTR)
+			;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		late = (now.tv_sec-next.tv_sec)*1000000000+
+			(now.tv_nsec-next.tv_nsec);
+		HistAdd(&probeLatency, (late>0) ? late : 0);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Wait till either the DCD, CTS or DSR line changes status on the serial port.
+ * Returns -1 on a time out, or SERIAL_FAILED if the port cannot be read.
+ */
+int WaitOnSerialChange(struct portInfo *p, struct timespec *ts)
+{
+	uint64_t start;
+	int arg;
+
+
+	/* poll for the DCD, CTS or DSR line to change status */
+	if (p->poll==1)
+		return PollSerialChange(p, ts);
+
+	/* wait till a serial port status change interrupt is generated, the
+	   watchdog in the main thread signals us if this takes too long */
+	CountAdd(&p->counters.waits, 1);
+	if (ioctl(p->fd, TIOCMIWAIT, TIOCM_CD | TIOCM_CTS | TIOCM_DSR)!=0)
+		return SerialError();
+	clock_gettime(CLOCK_REALTIME, ts);
+	CountAdd(&p->counters.gets, 1);
+	start = MonotonicNow();
+	if (ioctl(p->fd, TIOCMGET, &arg)!=0)
+		return SerialError();
+	HistAdd(&p->latency[LATENCY_GET], MonotonicNow()-start);
+
+	return arg;
+}
+
+
+/*
+ * Hand an edge to the worker thread of a port, called only by its capture
+ * thread. If the worker has fallen so far behind that the queue is full the
+ * edge is dropped rather than the capture thread waiting.
+ */
+int QueueEdge(struct portInfo *p, int status, struct timespec *ts,
+	struct timespec *edge)
+{
+	struct edgeQueue *q = &p->queue;
+	struct edgeEvent *e;
+	unsigned int head,depth;
+	uint64_t one = 1;
+	int i;
+
+	head = q->head;
+	depth = head-__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	if (depth>=EDGE_QUEUE) {
+		CountAdd(&q->overflows, 1);
+		return -1;
+	}
+
+	e = &q->event[head & (EDGE_QUEUE-1)];
+	e->status = status;
+	e->ts = *ts;
+	for (i=0;i<3;i++)
+		e->edge[i] = (edge!=NULL) ? edge[i] : *ts;
+	e->queued = MonotonicNow();
+	__atomic_store_n(&q->head, head+1, __ATOMIC_RELEASE);
+
+	if (depth+1>q->deepest)
+		__atomic_store_n(&q->deepest, depth+1, __ATOMIC_RELAXED);
+
+	/* wake the worker */
+	CountAdd(&p->counters.notifies, 1);
+	write(q->fd, &one, sizeof(one));
+
+	return 0;
+}
+
+
+/*
+ * Take the oldest edge off the queue of a port, called only by its worker
+ * thread. Returns -1 if the queue is empty.
+ */
+int DequeueEdge(struct portInfo *p, struct edgeEvent *e)
+{
+	struct edgeQueue *q = &p->queue;
+	unsigned int tail;
+
+	tail = q->tail;
+	if (tail==__atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return -1;
+
+	*e = q->event[tail & (EDGE_QUEUE-1)];
+	__atomic_store_n(&q->tail, tail+1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+
+/*
+ * Number of edges waiting for the worker thread of a port
+ */
+unsigned int QueueDepth(struct edgeQueue *q)
+{
+	return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)-
+		__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Log the counters of a capture thread, including the average number of
+ * system calls it has needed for each edge, and of the queue to its worker
+ */
+void LogCounters(struct portInfo *p)
+{
+	struct portCounters counters, *n = &counters;
+	unsigned long calls,rejected,overflows;
+	unsigned int depth,deepest;
+	double average;
+	int i;
+
+	/* the capture thread goes on counting while these are read */
+	n->edges = CountGet(&p->counters.edges);
+	n->timeouts = CountGet(&p->counters.timeouts);
+	n->waits = CountGet(&p->counters.waits);
+	n->gets = CountGet(&p->counters.gets);
+	n->fetches = CountGet(&p->counters.fetches);
+	n->sleeps = CountGet(&p->counters.sleeps);
+	n->notifies = CountGet(&p->counters.notifies);
+	deepest = __atomic_load_n(&p->queue.deepest, __ATOMIC_RELAXED);
+	overflows = CountGet(&p->queue.overflows);
+
+	calls = n->waits+n->gets+n->fetches+n->sleeps+n->notifies;
+	for (i=0,rejected=0;i<3;i++)
+		rejected += p->line[i].offsets.rejected;
+	average = (n->edges>0) ? (double) calls/n->edges : 0.0;
+
+	depth = QueueDepth(&p->queue);
+
+	if (test==0)
+		syslog(LOG_INFO, "%s: %lu edges %lu timeouts %lu TIOCMIWAIT "
+			"%lu TIOCMGET %lu PPS fetches %lu sleeps %lu wakeups, "
+			"%.2f system calls per edge, %lu outlying pulses, "
+			"%u edges queued %u most queued %lu lost to overflow",
+			p->name, n->edges, n->timeouts, n->waits, n->gets,
+			n->fetches, n->sleeps, n->notifies, average, rejected,
+			depth, deepest, overflows);
+	else
+		fprintf(stderr, "radioclkd: %s: %lu edges %lu timeouts %lu "
+			"TIOCMIWAIT %lu TIOCMGET %lu PPS fetches %lu sleeps "
+			"%lu wakeups, %.2f system calls per edge, %lu outlying "
+			"pulses, %u edges queued %u most queued %lu lost to "
+			"overflow\n", p->name, n->edges, n->timeouts, n->waits,
+			n->gets, n->fetches, n->sleeps, n->notifies, average,
+			rejected, depth, deepest, overflows);
+
+	for (i=0;i<LATENCY_STAGES;i++)
+		LogLatency(p->name, latencyName[i], &p->latency[i]);
+
+	return;
+}
+
+
+/*
+ * Place a time stamp in the SHM segment for the NTP reference clock driver.
+ * The count is bumped both before and after the time stamp is written, so a
+ * reader in mode 1 that sees the same count either side of reading it cannot
+ * have read half of one time stamp and half of the next.
+ */
+void PutTimeStamp(struct timespec *local, struct timespec *radio,
+	struct shmTime *shm, int leap, int precision)
+{
+	shm->mode = 1;
+	shm->valid = 0;
+	shm->count++;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	shm->leap = leap;
+	shm->precision = precision;
+	shm->clockTimeStampSec = (time_t) radio->tv_sec;
+	shm->clockTimeStampUSec = (int) (radio->tv_nsec/1000);
+	shm->clockTimeStampNSec = (unsigned) radio->tv_nsec;
+	shm->receiveTimeStampSec = (time_t) local->tv_sec;
+	shm->receiveTimeStampUSec = (int) (local->tv_nsec/1000);
+	shm->receiveTimeStampNSec = (unsigned) local->tv_nsec;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	shm->count++;
+	shm->valid = 1;
+
+	return;
+}
+
+
+/*
+ * Add a time stamp to the ring of samples in an extended SHM segment
+ */
+void PutRingSample(struct timespec *local, struct timespec *radio,
+	struct shmRing *ring, int leap, int precision)
+{
+	struct shmSample *sample;
+	uint32_t head;
+
+	head = ring->head;
+	sample = &ring->sample[head%SHM_SAMPLES];
+
+	/* an odd sequence marks the slot as being written */
+	__atomic_store_n(&sample->seq, sample->seq+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	sample->index = head;
+	sample->clockSec = radio->tv_sec;
+	sample->clockNSec = radio->tv_nsec;
+	sample->receiveSec = local->tv_sec;
+	sample->receiveNSec = local->tv_nsec;
+	sample->leap = leap;
+	sample->precision = precision;
+
+	__atomic_store_n(&sample->seq, sample->seq+1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+
+	return;
+}
+
+
+/*
+ * Record a time stamp published during a benchmark, checking it against the
+ * signal that was generated
+ */
+void BenchSample(struct clockInfo *c, struct timespec *local,
+	struct timespec *radio, int leap)
+{
+	struct timespec now,diff;
+	long offset;
+
+	/* the full cost of publishing is part of the latency */
+	PutTimeStamp(local, radio, &bench->shm.legacy, leap, c->precision);
+	PutRingSample(local, radio, &bench->shm, leap, c->precision);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* only the time stamps of decoded minutes are scored */
+	if ((__atomic_load_n(&perSecond, __ATOMIC_RELAXED)!=PER_SECOND_OFF) &&
+			(radio->tv_sec%60!=0))
+		return;
+
+	/* the local time stamp is the generated edge, so anything more than
+	   half a second out was decoded as the wrong minute */
+	TimeSpecSub(local, radio, &diff);
+	offset = (diff.tv_sec*1000000000)+diff.tv_nsec-bench->delay;
+	if ((radio->tv_nsec!=0) || (radio->tv_sec<=bench->start) ||
+			(radio->tv_sec>bench->start+(bench->minutes*60)) ||
+			((radio->tv_sec-bench->start)%60!=0) ||
+			(labs(offset)>=500000000)) {
+		bench->wrong++;
+		return;
+	}
+
+	TimeSpecSub(&now, &bench->edge, &diff);
+	bench->latency[bench->decoded] = (diff.tv_sec*1000000000)+diff.tv_nsec;
+	bench->offset[bench->decoded] = offset;
+	bench->decoded++;
+
+	return;
+}
+
+
+/*
+ * Push a time stamp to the SOCK reference clock driver of chrony, the socket
+ * for each unit being the path given with the unit number appended. The
+ * socket is non blocking so a chronyd that is not keeping up can never hold
+ * up the decoding.
+ */
+int SendSockSample(struct clockInfo *c, struct timespec *local,
+	struct timespec *radio, int leap)
+{
+	struct sockSample sample;
+	struct sockaddr_un addr;
+	struct timespec diff;
+
+	if (c->sockfd<0) {
+		c->sockfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK |
+			SOCK_CLOEXEC, 0);
+		if (c->sockfd<0)
+			return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.%d",
+		c->config.chrony, c->unit);
+
+	/* the offset is the same at the time stamp truncated to microseconds */
+	memset(&sample, 0, sizeof(sample));
+	sample.tv.tv_sec = local->tv_sec;
+	sample.tv.tv_usec = local->tv_nsec/1000;
+	TimeSpecSub(radio, local, &diff);
+	sample.offset = diff.tv_sec+(diff.tv_nsec*1e-9);
+	sample.pulse = 0;
+	sample.leap = leap;
+	sample.magic = SOCK_MAGIC;
+
+	if (sendto(c->sockfd, &sample, sizeof(sample), 0,
+			(struct sockaddr *) &addr, sizeof(addr))!=sizeof(sample)) {
+		/* only complain once till chronyd is back */
+		if (c->sockerror==0)
+			syslog(LOG_INFO, "unable to send time stamp to %s: %m",
+				addr.sun_path);
+		c->sockerror = 1;
+		return -1;
+	}
+	c->sockerror = 0;
+
+	return 0;
+}
+
+
+/*
+ * Publish a time stamp for ntpd or chronyd, or print it on stdout when
+ * replaying
+ */
+int PublishSample(struct clockInfo *c, struct timespec *local,
+	struct timespec *radio, int leap)
+{
+	struct timespec corrected;
+	int shmid;
+
+	/* the edge arrived late by the delay of the receiver and the signal
+	   path, so take it off the system time it arrived at */
+	if (c->delay!=0) {
+		corrected = *local;
+		TimeSpecAdd(&corrected, -c->delay);
+		local = &corrected;
+	}
+
+	c->stats->published++;
+	c->stats->precision = c->precision;
+
+	if (replay==1) {
+		if (bench!=NULL) {
+			BenchSample(c, local, radio, leap);
+			return 0;
+		}
+		if (c->config.chrony[0]!='\0')
+			SendSockSample(c, local, radio, leap);
+		fprintf(stdout, "%d %lld.%09ld %lld.%09ld %d %d\n", c->unit,
+			(long long) local->tv_sec, (long) local->tv_nsec,
+			(long long) radio->tv_sec, (long) radio->tv_nsec,
+			leap, c->precision);
+		return 0;
+	}
+
+	if (c->config.chrony[0]!='\0')
+		return SendSockSample(c, local, radio, leap);
+
+	/* attach shared memory segment if not already done */
+	if (c->stamp==NULL) {
+		c->stamp = AttachSharedMemory(c->unit, &shmid, &c->ring);
+		if ((shmid==-1) || (c->stamp==NULL)) {
+			syslog(LOG_INFO, "unable to attach shared "
+				"memory for %s", c->line);
+			return -1;
+		}
+	}
+
+	PutTimeStamp(local, radio, c->stamp, leap, c->precision);
+	if (c->ring!=NULL)
+		PutRingSample(local, radio, c->ring, leap, c->precision);
+
+	return 0;
+}
+
+
+/*
+ * Compare two samples in a window by offset, breaking ties by their slot so
+ * that every sample has a distinct position in the tree
+ */
+static inline int WindowLess(struct offsetWindow *w, int a, int b)
+{
+	if (w->node[a].value!=w->node[b].value)
+		return (w->node[a].value<w->node[b].value);
+	return (a<b);
+}
+
+
+/*
+ * Recompute the size and sum of the subtree rooted at a node
+ */
+static inline void WindowUpdate(struct offsetWindow *w, int t)
+{
+	struct windowNode *n = &w->node[t];
+
+	n->size = 1;
+	n->sum = n->value;
+	if (n->left>=0) {
+		n->size += w->node[n->left].size;
+		n->sum += w->node[n->left].sum;
+	}
+	if (n->right>=0) {
+		n->size += w->node[n->right].size;
+		n->sum += w->node[n->right].sum;
+	}
+
+	return;
+}
+
+
+/*
+ * Split a subtree into the samples ordered before slot k and the rest
+ */
+static void WindowSplit(struct offsetWindow *w, int t, int k, int *l, int *r)
+{
+	if (t<0) {
+		*l = *r = -1;
+		return;
+	}
+	if (WindowLess(w, t, k)) {
+		WindowSplit(w, w->node[t].right, k, &w->node[t].right, r);
+		*l = t;
+	} else {
+		WindowSplit(w, w->node[t].left, k, l, &w->node[t].left);
+		*r = t;
+	}
+	WindowUpdate(w, t);
+
+	return;
+}
+
+
+/*
+ * Join two subtrees, every sample in the first ordered before the second
+ */
+static int WindowMerge(struct offsetWindow *w, int a, int b)
+{
+	if (a<0)
+		return b;
+	if (b<0)
+		return a;
+	if (w->node[a].priority>w->node[b].priority) {
+		w->node[a].right = WindowMerge(w, w->node[a].right, b);
+		WindowUpdate(w, a);
+		return a;
+	} else {
+		w->node[b].left = WindowMerge(w, a, w->node[b].left);
+		WindowUpdate(w, b);
+		return b;
+	}
+}
+
+
+/*
+ * Insert the sample in slot k into a subtree, returning its new root
+ */
+static int WindowInsert(struct offsetWindow *w, int t, int k)
+{
+	if (t<0)
+		return k;
+	if (w->node[k].priority>w->node[t].priority) {
+		WindowSplit(w, t, k, &w->node[k].left, &w->node[k].right);
+		WindowUpdate(w, k);
+		return k;
+	}
+	if (WindowLess(w, k, t))
+		w->node[t].left = WindowInsert(w, w->node[t].left, k);
+	else
+		w->node[t].right = WindowInsert(w, w->node[t].right, k);
+	WindowUpdate(w, t);
+
+	return t;
+}
+
+
+/*
+ * Remove the sample in slot k from a subtree, returning its new root
+ */
+static int WindowErase(struct offsetWindow *w, int t, int k)
+{
+	if (t==k)
+		return WindowMerge(w, w->node[t].left, w->node[t].right);
+	if (WindowLess(w, k, t))
+		w->node[t].left = WindowErase(w, w->node[t].left, k);
+	else
+		w->node[t].right = WindowErase(w, w->node[t].right, k);
+	WindowUpdate(w, t);
+
+	return t;
+}
+
+
+/*
+ * Empty a window and set the number of seconds it covers
+ */
+void WindowReset(struct offsetWindow *w, int size)
+{
+	w->size = (size>WINDOW_MAX) ? WINDOW_MAX : size;
+	w->head = 0;
+	w->count = 0;
+	w->run = 0;
+	w->root = -1;
+	if (w->seed==0)
+		w->seed = 0x9e3779b9;
+
+	return;
+}
+
+
+/*
+ * Drop the oldest sample in a window
+ */
+static void WindowDropOldest(struct offsetWindow *w)
+{
+	w->root = WindowErase(w, w->root, w->head);
+	w->head = (w->head+1)%w->size;
+	w->count--;
+
+	return;
+}
+
+
+/*
+ * Drop the samples that have slid out of a window
+ */
+void WindowExpire(struct offsetWindow *w, time_t now)
+{
+	while ((w->count>0) && (w->stamp[w->head]<=now-w->size))
+		WindowDropOldest(w);
+
+	return;
+}
+
+
+/*
+ * The k'th smallest offset in a window, counting from zero
+ */
+long WindowRank(struct offsetWindow *w, int k)
+{
+	int t,left;
+
+	t = w->root;
+	while (t>=0) {
+		left = (w->node[t].left>=0) ? w->node[w->node[t].left].size : 0;
+		if (k<left) {
+			t = w->node[t].left;
+		} else if (k==left) {
+			return w->node[t].value;
+		} else {
+			k -= left+1;
+			t = w->node[t].right;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Sum of the k smallest offsets in a window
+ */
+static long long WindowPrefixSum(struct offsetWindow *w, int k)
+{
+	int t,left;
+	long long sum;
+
+	sum = 0;
+	t = w->root;
+	while ((t>=0) && (k>0)) {
+		left = (w->node[t].left>=0) ? w->node[w->node[t].left].size : 0;
+		if (k<=left) {
+			t = w->node[t].left;
+		} else {
+			if (left>0)
+				sum += w->node[w->node[t].left].sum;
+			sum += w->node[t].value;
+			k -= left+1;
+			t = w->node[t].right;
+		}
+	}
+
+	return sum;
+}
+
+
+/*
+ * Add the offset of a pulse from the system clock's second to a window.
+ * Pulses too far from the second, or from the median of the window, are
+ * rejected on their own, unless so many are rejected in a row that the
+ * system clock must have been stepped. Returns -1 if the pulse is rejected.
+ */
+int WindowAdd(struct offsetWindow *w, time_t now, long value)
+{
+	int k;
+
+	WindowExpire(w, now);
+
+	/* if the time isn't close, don't bother tracking it */
+	if (labs(value)>MAX_OFFSET) {
+		w->rejected++;
+		return -1;
+	}
+
+	/* check against the median once there are enough samples */
+	if ((w->count>=8) &&
+			(labs(value-WindowRank(w, w->count/2))>MAX_SPREAD)) {
+		if (++w->run<w->size/2) {
+			w->rejected++;
+			return -1;
+		}
+		WindowReset(w, w->size);
+	}
+	w->run = 0;
+
+	if (w->count==w->size)
+		WindowDropOldest(w);
+
+	/* the slot becomes a new leaf with a random priority */
+	k = (w->head+w->count)%w->size;
+	w->seed ^= w->seed<<13;
+	w->seed ^= w->seed>>17;
+	w->seed ^= w->seed<<5;
+	w->stamp[k] = now;
+	w->node[k].value = value;
+	w->node[k].priority = w->seed;
+	w->node[k].left = -1;
+	w->node[k].right = -1;
+	WindowUpdate(w, k);
+	w->root = WindowInsert(w, w->root, k);
+	w->count++;
+
+	return 0;
+}
+
+
+/*
+ * Change the number of seconds a window covers, keeping the newest samples
+ * that still fall in it
+ */
+void WindowResize(struct offsetWindow *w, int size)
+{
+	time_t stamp[WINDOW_MAX];
+	long value[WINDOW_MAX];
+	int i,k,n;
+
+	n = w->count;
+	for (i=0;i<n;i++) {
+		k = (w->head+i)%w->size;
+		stamp[i] = w->stamp[k];
+		value[i] = w->node[k].value;
+	}
+
+	WindowReset(w, size);
+	for (i=(n>w->size) ? n-w->size : 0;i<n;i++)
+		WindowAdd(w, stamp[i], value[i]);
+
+	return;
+}
+
+
+/*
+ * Calculate the average measured offset of the start of the radioclock
+ * pulses from the true time, as the mean of the middle half of the pulses in
+ * the window. Fails if fewer than a quarter of the window's pulses were seen.
+ */
+int WindowTrimmedMean(struct offsetWindow *w, time_t now, int *average)
+{
+	int lo,hi;
+
+	WindowExpire(w, now);
+	if ((w->count==0) || (w->count<(w->size+3)/4))
+		return -1;
+
+	lo = w->count/4;
+	hi = w->count-lo;
+	*average = (int) ((WindowPrefixSum(w, hi)-WindowPrefixSum(w, lo))/
+		(hi-lo));
+
+	return 0;
+}
+
+
+/*
+ * Start a tracking filter over again
+ */
+void FilterReset(struct trackFilter *f)
+{
+	memset(f, 0, sizeof(struct trackFilter));
+
+	return;
+}
+
+
+/*
+ * Update a tracking filter with the offset in ns of a second marker from the
+ * system clock, measured with a noise variance of r. Returns -1 if the
+ * offset is too far from that predicted to be believed.
+ */
+int FilterUpdate(struct trackFilter *f, struct timespec *ts, double z,
+	double r)
+{
+	struct timespec diff;
+	double dt,q00,q01,q11,p00,p01,p11,y,s,k0,k1;
+
+	/* a long gap means the old state is of no use */
+	TimeSpecSub(ts, &f->last, &diff);
+	dt = diff.tv_sec+(diff.tv_nsec*1e-9);
+	if ((f->updates>0) && ((dt<=0.0) || (dt>FILTER_GAP)))
+		FilterReset(f);
+
+	/* the first second marker sets the phase, with the frequency unknown
+	   to within the tolerance of the system clock */
+	if (f->updates==0) {
+		f->phase = z;
+		f->freq = 0.0;
+		f->p00 = r;
+		f->p01 = 0.0;
+		f->p11 = FILTER_FREQ_VAR;
+		f->last = *ts;
+		f->updates = 1;
+		return 0;
+	}
+
+	/* predict the state forward to this second marker, the phase noise of
+	   the system clock being white and its frequency a random walk */
+	q00 = (FILTER_PHASE_NOISE*dt)+(FILTER_FREQ_NOISE*dt*dt*dt/3.0);
+	q01 = FILTER_FREQ_NOISE*dt*dt/2.0;
+	q11 = FILTER_FREQ_NOISE*dt;
+	p00 = f->p00+(2.0*dt*f->p01)+(dt*dt*f->p11)+q00;
+	p01 = f->p01+(dt*f->p11)+q01;
+	p11 = f->p11+q11;
+	y = z-(f->phase+(f->freq*dt));
+	s = p00+r;
+
+	/* gate the innovation, starting over if the system clock appears to
+	   have been stepped */
+	if (y*y>FILTER_GATE*FILTER_GATE*s) {
+		if (++f->rejects>=FILTER_REJECTS)
+			FilterReset(f);
+		return -1;
+	}
+	f->rejects = 0;
+
+	/* correct the state with the measurement */
+	k0 = p00/s;
+	k1 = p01/s;
+	f->phase += (f->freq*dt)+(k0*y);
+	f->freq += k1*y;
+	f->p00 = (1.0-k0)*p00;
+	f->p01 = (1.0-k0)*p01;
+	f->p11 = p11-(k1*p01);
+	f->last = *ts;
+	f->updates++;
+
+	return 0;
+}
+
+
+/*
+ * The filtered offset in ns of the system clock at a time, and the precision
+ * of it as a power of two seconds. Returns -1 until the filter has settled.
+ */
+int FilterOffset(struct trackFilter *f, struct timespec *ts, double *offset,
+	int *precision)
+{
+	struct timespec diff;
+	double dt,sigma;
+
+	if (f->updates<FILTER_SETTLE)
+		return -1;
+
+	TimeSpecSub(ts, &f->last, &diff);
+	dt = diff.tv_sec+(diff.tv_nsec*1e-9);
+	*offset = f->phase+(f->freq*dt);
+
+	sigma = sqrt(f->p00+(2.0*dt*f->p01)+(dt*dt*f->p11))*1e-9;
+	*precision = (sigma>0.0) ? (int) ceil(log2(sigma)) : PRECISION_MIN;
+	if (*precision<PRECISION_MIN)
+		*precision = PRECISION_MIN;
+	if (*precision>-1)
+		*precision = -1;
+
+	return 0;
+}
+
+
+/*
+ * The noise variance in ns^2 of the second markers, from the interquartile
+ * range of the offsets in the window
+ */
+double WindowNoise(struct offsetWindow *w)
+{
+	double sigma;
+
+	if (w->count<8)
+		return FILTER_NOISE;
+
+	sigma = (WindowRank(w, (3*w->count)/4)-WindowRank(w, w->count/4))/
+		1.349;
+	if (sigma*sigma<FILTER_MIN_NOISE)
+		return FILTER_MIN_NOISE;
+
+	return sigma*sigma;
+}
+
+
+/*
+ * The system time of the second marker just received, using the offset
+ * from the nearest second of the tracking filter once it has settled, or
+ * else the averaged offset of the pulses if possible
+ */
+void LocalTime(struct clockInfo *c, struct timespec *computer)
+{
+	time_t second;
+	int average;
+	double offset;
+
+	second = c->start.tv_sec+((c->start.tv_nsec>500000000) ? 1 : 0);
+	c->precision = PRECISION;
+	if (FilterOffset(&c->filter, &c->start, &offset,
+			&c->precision)==0) {
+		computer->tv_sec = second;
+		computer->tv_nsec = 0;
+		TimeSpecAdd(computer, lrint(offset));
+	} else if (WindowTrimmedMean(&c->offsets, c->start.tv_sec,
+			&average)<0) {
+		computer->tv_sec = c->start.tv_sec;
+		computer->tv_nsec = c->start.tv_nsec;
+	} else if (average<0) {
+		computer->tv_sec = second-1;
+		computer->tv_nsec = average+1000000000;
+	} else {
+		computer->tv_sec = second;
+		computer->tv_nsec = average;
+	}
+
+	return;
+}
+
+
+/*
+ * Once a minute has been decoded every following second marker has a known
+ * UTC time, counting on from the last labeled marker for as long as they keep
+ * arriving close to whole seconds apart. Publish a sample for each of them.
+ */
+void LabelSecond(struct clockInfo *c)
+{
+	struct timespec elapsed,computer,received;
+	long err;
+	int seconds;
+
+	/* changed by the main thread when the configuration is read again */
+	seconds = __atomic_load_n(&perSecond, __ATOMIC_RELAXED);
+	if ((seconds==PER_SECOND_OFF) || (c->label<0))
+		return;
+
+	/* round the time since the last labeled marker to whole seconds */
+	TimeSpecSub(&c->start, &c->labeled, &elapsed);
+	err = elapsed.tv_nsec;
+	if (err>=500000000) {
+		elapsed.tv_sec++;
+		err -= 1000000000;
+	}
+
+	/* a long gap loses the count, a pulse out of place is ignored */
+	if (elapsed.tv_sec>MAX_FLYWHEEL) {
+		c->label = -1;
+		return;
+	}
+	if ((elapsed.tv_sec<1) || (labs(err)>MAX_SPREAD))
+		return;
+
+	c->label += elapsed.tv_sec;
+	c->labeled.tv_sec = c->start.tv_sec;
+	c->labeled.tv_nsec = c->start.tv_nsec;
+	if (test==1)
+		return;
+
+	if (seconds==PER_SECOND_MEAN) {
+		LocalTime(c, &computer);
+	} else {
+		computer.tv_sec = c->start.tv_sec;
+		computer.tv_nsec = c->start.tv_nsec;
+		c->precision = PRECISION;
+	}
+	received.tv_sec = c->label;
+	received.tv_nsec = 0;
+	if (PublishSample(c, &computer, &received, LEAP_NOWARNING)==0)
+		c->published = c->label;
+
+	return;
+}
+
+
+/*
+ * Checkpoint the tracking state of a line to the state file
+ */
+void SaveState(struct clockInfo *c)
+{
+	struct savedLine *s = c->saved;
+
+	if (s==NULL)
+		return;
+
+	__atomic_store_n(&s->seq, s->seq+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	s->saved = c->start.tv_sec;
+	s->phase = c->phase;
+	s->phaseHits = c->phaseHits;
+	s->last = c->last;
+	s->published = c->published;
+	s->lock = c->lock;
+	s->filter = c->filter;
+	s->widths = c->widths;
+	__atomic_store_n(&s->seq, s->seq+1, __ATOMIC_RELEASE);
+
+	return;
+}
+
+
+/*
+ * Give up on the state carried over from the last run, as the second markers
+ * received since do not bear it out, and start over from what they say
+ */
+void WarmFail(struct clockInfo *c, char *why)
+{
+	c->warm = 0;
+	if (c->lock.locked==1) {
+		c->lock.locked = 0;
+		c->stats->unlocks++;
+	}
+	FilterReset(&c->filter);
+	c->label = -1;
+
+	if (test==0)
+		syslog(LOG_INFO, "%s state carried over dropped, %s", c->line,
+			why);
+	else
+		fprintf(stdout, "%s state carried over dropped, %s\n", c->line,
+			why);
+
+	return;
+}
+
+
+/*
+ * Add the start of the pulse just received to the clock offset window and
+ * the tracking filter, and publish it if it can be labeled
+ */
+void RecordPulse(struct clockInfo *c)
+{
+	long err;
+
+	/* the DCF77 minute marker is recorded when it starts, so it is not
+	   recorded again when its length is known */
+	if ((c->start.tv_sec==c->pulse.tv_sec) &&
+			(c->start.tv_nsec==c->pulse.tv_nsec))
+		return;
+	c->pulse.tv_sec = c->start.tv_sec;
+	c->pulse.tv_nsec = c->start.tv_nsec;
+
+	err = c->start.tv_nsec;
+	if (err>500000000)
+		err -= 1000000000;
+	if ((WindowAdd(&c->offsets, c->start.tv_sec, err)==0) &&
+			(FilterUpdate(&c->filter, &c->start, (double) err,
+			WindowNoise(&c->offsets))!=0) && (c->warm>0))
+		WarmFail(c, "offset not as expected");
+	c->stats->offset = err;
+	c->stats->phase = c->filter.phase;
+	c->stats->freq = c->filter.freq;
+	c->stats->filtered = c->filter.updates;
+	LabelSecond(c);
+	SaveState(c);
+
+	return;
+}
+
+
+/*
+ * The second of the system clock that the pulse just started marks, at the
+ * phase of the second markers before it
+ */
+time_t PulseSecond(struct clockInfo *c)
+{
+	long d;
+
+	/* the phase is taken as an offset either side of the second */
+	d = c->start.tv_nsec-((c->phase>=500000000) ?
+		c->phase-1000000000 : c->phase);
+	if (d>=500000000)
+		return c->start.tv_sec+1;
+	else if (d<-500000000)
+		return c->start.tv_sec-1;
+
+	return c->start.tv_sec;
+}
+
+
+/*
+ * Is the pulse just started a second marker, judged by the phase within the
+ * second of those before it. Until PHASE_LOCK markers in a row have agreed
+ * on the phase every pulse is taken to be one. Once locked pulses out of
+ * phase are ignored, unless PHASE_MISSES of them come in a row.
+ */
+int OnPhase(struct clockInfo *c)
+{
+	return ((c->phaseHits<PHASE_LOCK) ||
+		(labs(PhaseError(c->phase, c->start.tv_nsec))<=MAX_SPREAD));
+}
+
+
+/*
+ * Learn the phase of the second markers from the pulse just started, and
+ * give the second it marks if it is one
+ */
+int SecondMarker(struct clockInfo *c, time_t *second)
+{
+	long d;
+
+	d = PhaseError(c->phase, c->start.tv_nsec);
+	if (labs(d)<=MAX_SPREAD) {
+		c->phase += d/((c->phaseHits<PHASE_LOCK) ? 2 : 8);
+		if (c->phase<0)
+			c->phase += 1000000000;
+		else if (c->phase>=1000000000)
+			c->phase -= 1000000000;
+		if (c->phaseHits<PHASE_LOCK)
+			c->phaseHits++;
+		c->phaseMisses = 0;
+	} else if ((c->phaseHits<PHASE_LOCK) || (++c->phaseMisses>
+			((c->warm>0) ? PHASE_LOCK : PHASE_MISSES))) {
+		if (c->warm>0)
+			WarmFail(c, "second markers out of phase");
+		c->phase = c->start.tv_nsec;
+		c->phaseHits = 1;
+		c->phaseMisses = 0;
+	} else {
+		return 0;
+	}
+
+	*second = PulseSecond(c);
+
+	return 1;
+}
+
+
+/*
+ * Bring the frame up to the second before the one marked by the pulse just
+ * received, erasing the seconds in which no second marker was seen. After
+ * a long gap the frame is started over.
+ */
+void AlignFrame(struct clockInfo *c, time_t second)
+{
+	time_t gap;
+
+	gap = second-c->second-1;
+	if ((c->second==0) || (gap<0) || (gap>=64)) {
+		if (c->second!=0)
+			c->stats->resets++;
+		memset(&c->bits, 0, sizeof(c->bits));
+		c->count = 1;
+		c->marker = 0x00;
+		c->frame = 0;
+	} else {
+		c->stats->erasures += gap;
+		while (gap-->0) {
+			PushSymbol(&c->bits, SYMBOL_ERASED);
+			c->count++;
+			c->marker = c->marker<<1;
+			c->frame = 0;
+		}
+	}
+	c->second = second;
+
+	return;
+}
+
+
+/*
+ * Fill in the table of the log likelihood of each width of pulse for each
+ * pulse type. Called before the capture threads are started.
+ */
+void SoftInit(void)
+{
+	static const short width[SOFT_TYPES] = { 0, 100, 200, 300, 500, 800,
+		100 };
+	double g;
+	int i,k;
+
+	if (softReady==1)
+		return;
+
+	for (k=0;k<SOFT_TYPES;k++) {
+		for (i=0;i<=SOFT_MAX_WIDTH;i++) {
+			if (k==0) {
+				softLikelihood[k][i] = log(SOFT_SPURIOUS);
+				continue;
+			}
+			g = (i-width[k])/SOFT_WIDTH;
+			softLikelihood[k][i] = log(((1.0-SOFT_SPURIOUS)*
+				exp(-g*g/2.0))+SOFT_SPURIOUS);
+		}
+	}
+	softReady = 1;
+
+	return;
+}
+
+
+/*
+ * The pulse type index used by the soft decoder of a generated symbol
+ */
+static inline int SoftType(int symbol)
+{
+	switch (symbol) {
+		case SYMBOL_100:
+			return 1;
+		case SYMBOL_200:
+			return 2;
+		case SYMBOL_300:
+			return 3;
+		case SYMBOL_500:
+			return 4;
+		case SYMBOL_800:
+			return 5;
+		case SYMBOL_B:
+			return 6;
+		default:
+			return 0;
+	}
+}
+
+
+/*
+ * Is a second of the time code one that cannot be predicted, such as the
+ * DUT1 bits or the DCF77 weather bits, so must be left out of the evidence
+ */
+static inline int SoftIgnore(int radio, int second)
+{
+	switch (radio) {
+		case DCF77:
+			return (((second>=1) && (second<=15)) || (second==19));
+		case MSF:
+			return ((second>=1) && (second<=16));
+		case WWVB:
+			return (((second>=36) && (second<=43) && (second!=39)) ||
+				(second==56));
+	}
+
+	return 1;
+}
+
+
+/*
+ * The log likelihood of what was seen in a second given its pulse type
+ */
+static inline double SoftScore(struct softFrame *f, time_t s, int type)
+{
+	int i = s%SOFT_SECONDS;
+	double extra;
+
+	if (f->second[i]!=s)
+		return (type==0) ? log(1.0-SOFT_DROP) : log(SOFT_DROP);
+
+	if (type==6)
+		extra = (f->extra[i]==1) ? log(0.9) : log(0.1);
+	else
+		extra = (f->extra[i]==1) ? log(0.02) : log(0.98);
+
+	return softLikelihood[type][f->width[i]]+extra;
+}
+
+
+/*
+ * Does the pulse kept for a second look more like the pulse type expected
+ * than any other
+ */
+static inline int SoftMatch(struct softFrame *f, time_t s, int type)
+{
+	double score;
+	int i;
+
+	if (type==0)
+		return 0;
+
+	score = SoftScore(f, s, type);
+	for (i=1;i<SOFT_TYPES;i++)
+		if (SoftScore(f, s, i)>score)
+			return 0;
+
+	return 1;
+}
+
+
+/*
+ * Encode the time code of a minute as the pulse type of each second
+ */
+void SoftEncode(int radio, time_t minute, signed char *expect)
+{
+	static struct generator none;
+	int i,symbol[60];
+
+	switch (radio) {
+		case DCF77:
+			EncodeDCF77(&none, minute, symbol);
+			break;
+		case MSF:
+			EncodeMSF(&none, minute, symbol);
+			break;
+		default:
+			EncodeWWVB(&none, minute, symbol);
+			break;
+	}
+	for (i=0;i<60;i++)
+		expect[i] = (SoftIgnore(radio, i)==1) ? -1 : SoftType(symbol[i]);
+
+	return;
+}
+
+
+/*
+ * The log likelihood of the pulses kept before the second marker s0 if the
+ * minute starting at s0 is the one given
+ */
+double SoftEvidence(struct clockInfo *c, int radio, time_t s0, time_t minute)
+{
+	signed char expect[60];
+	time_t s,u,encoded;
+	double ll;
+
+	ll = 0.0;
+	encoded = -1;
+	for (s=s0-SOFT_SECONDS;s<s0;s++) {
+		u = s+minute-s0;
+		if (u-(u%60)!=encoded) {
+			encoded = u-(u%60);
+			SoftEncode(radio, encoded, expect);
+		}
+		if (expect[u%60]>=0)
+			ll += SoftScore(&c->soft, s, expect[u%60]);
+	}
+
+	return ll;
+}
+
+
+/*
+ * Publish the time stamp for the start of a minute, the second marker of
+ * which has just been received, saying how the minute was known in test mode
+ */
+int PublishMinute(struct clockInfo *c, time_t minute, char *how)
+{
+	struct timespec computer,received;
+	time_t last;
+	char buffer[32];
+
+	/* place time stamp into shared memory segment or print on stdout */
+	if (test==0) {
+		/* final sanity check on the time */
+		if (abs(c->start.tv_sec-minute)>1000) {
+			syslog(LOG_INFO, "decoded time differs from system "
+				"time by more than 1000s ignored");
+			return -1;
+		}
+
+		/* if possible use an averaged offset */
+		LocalTime(c, &computer);
+
+		/* put time stamp in shared memory segment for ntpd, unless it
+		   was already sent */
+		received.tv_sec = minute;
+		received.tv_nsec = 0;
+		if ((c->published!=minute) && (PublishSample(c, &computer,
+				&received, LEAP_NOWARNING)!=0))
+			return -1;
+
+		/* log any errors in getting the time */
+		last = minute-c->last;
+		if ((last>3600) && (c->error>0)) {
+			syslog(LOG_INFO, " %ldh %ldm since previous valid time "
+				"for %s line", last/3600, (last%3600)/60,
+				c->line);
+		} else if ((last>300) && (c->error>0)) {
+			syslog(LOG_INFO, " %ldm since previous valid time for %s"
+				" line", last/60, c->line);
+		}
+	} else if (c->published!=minute) {
+		/* any valid time is printed in testing mode */
+		flockfile(stdout);
+		if (how!=NULL)
+			fprintf(stdout, "%s %s\n", c->line, how);
+		fprintf(stdout, "%s UTC: %s", c->line,
+			ctime_r(&minute, buffer));
+		funlockfile(stdout);
+	}
+	c->published = minute;
+
+	/* reset the error warning and set last stamp time */
+	c->error = 0;
+	c->last = minute;
+	c->stats->lastFix = minute;
+
+	/* the following second markers can now be labeled */
+	c->label = minute;
+	c->labeled.tv_sec = c->start.tv_sec;
+	c->labeled.tv_nsec = c->start.tv_nsec;
+
+	return 0;
+}
+
+
+/*
+ * Great circle distance in km between two points given in degrees
+ */
+double GreatCircle(double lat1, double lon1, double lat2, double lon2)
+{
+	double a,dlat,dlon;
+
+	lat1 *= M_PI/180.0;
+	lat2 *= M_PI/180.0;
+	dlat = lat2-lat1;
+	dlon = (lon2-lon1)*M_PI/180.0;
+	a = (sin(dlat/2.0)*sin(dlat/2.0))+
+		(cos(lat1)*cos(lat2)*sin(dlon/2.0)*sin(dlon/2.0));
+
+	return 2.0*EARTH_RADIUS*atan2(sqrt(a), sqrt(1.0-a));
+}
+
+
+/*
+ * Work out the delay in ns to take off the time stamps of a line once the
+ * time signal it is receiving is known, that of the receiver plus the time
+ * the signal takes to arrive from the transmitter when the line has been
+ * given a location
+ */
+void SetTransmitter(struct clockInfo *c, int radio)
+{
+	const struct transmitter *t;
+	double distance;
+
+	if (c->radio==radio)
+		return;
+	c->radio = radio;
+	c->delay = c->config.delay;
+	if (c->config.located==0)
+		return;
+
+	for (t=transmitters;t->name!=NULL;t++)
+		if (t->radio==radio)
+			break;
+	if (t->name==NULL)
+		return;
+
+	distance = GreatCircle(c->config.latitude, c->config.longitude,
+		t->latitude, t->longitude);
+	c->delay += lround(distance*1e9/SIGNAL_SPEED);
+
+	if (test==0)
+		syslog(LOG_INFO, "%s receiving %s from %.0fkm away, delay "
+			"%.3fms", c->line, t->name, distance, c->delay/1e6);
+	else
+		fprintf(stdout, "%s receiving %s from %.0fkm away, delay "
+			"%.3fms\n", c->line, t->name, distance, c->delay/1e6);
+
+	return;
+}
+
+
+/*
+ * Lock on to a minute that has been decoded, the second marker of which was
+ * received at the system time s0
+ */
+void LockStart(struct clockInfo *c, int radio, time_t s0, time_t minute)
+{
+	struct lockState *l = &c->lock;
+
+	l->locked = 1;
+	l->radio = radio;
+	l->origin = s0;
+	l->minute = minute;
+	l->pending = -1;
+	l->good = 0;
+	l->errors = 0;
+	l->bad = 0;
+	l->verified = 1;
+	SoftEncode(radio, minute, l->expect);
+	SetTransmitter(c, radio);
+
+	return;
+}
+
+
+/*
+ * Move the lock on to the minute containing the second s, judging each
+ * minute passed by the errors seen in it. Too many errors in LOCK_BAD
+ * minutes in a row loses the lock.
+ */
+void LockAdvance(struct clockInfo *c, time_t s)
+{
+	struct lockState *l = &c->lock;
+	time_t n;
+
+	if (s<l->origin+60)
+		return;
+
+	if (l->errors>__atomic_load_n(&lockErrors, __ATOMIC_RELAXED)) {
+		l->verified = 0;
+		if (++l->bad>=LOCK_BAD) {
+			l->locked = 0;
+			c->stats->unlocks++;
+			return;
+		}
+	} else {
+		l->verified = (l->good>=LOCK_SEEN);
+		if (l->good>0)
+			l->bad = 0;
+	}
+
+	/* no pulses at all were seen in any other minutes passed */
+	n = (s-l->origin)/60;
+	if (n>1)
+		l->verified = 0;
+	l->origin += n*60;
+	l->minute += n*60;
+	l->good = 0;
+	l->errors = 0;
+	SoftEncode(l->radio, l->minute, l->expect);
+
+	return;
+}
+
+
+/*
+ * Check each pulse kept against the time code expected once locked, the
+ * previous second being checked as each new one arrives so that any MSF
+ * bit B pulse has been seen. When the second marker that starts a minute
+ * arrives after a minute that checked out, its time stamp is published
+ * without needing to be decoded.
+ */
+void LockCheck(struct clockInfo *c, time_t s)
+{
+	struct lockState *l = &c->lock;
+	int k;
+
+	if (l->locked==0)
+		return;
+	if ((s<l->origin) || (s-l->origin>LOCK_GAP)) {
+		l->locked = 0;
+		c->stats->unlocks++;
+		return;
+	}
+
+	/* check the previous second against the minute it was in */
+	if ((l->pending>=0) && (l->pending<s)) {
+		LockAdvance(c, l->pending);
+		if (l->locked==0)
+			return;
+		k = l->expect[l->pending-l->origin];
+		if ((k>=0) && (SoftMatch(&c->soft, l->pending, k)==1)) {
+			l->good++;
+		} else if (k>=0) {
+			l->errors++;
+			if ((c->warm>0) && (++c->warmErrors>WARM_ERRORS)) {
+				WarmFail(c, "pulses not as expected");
+				return;
+			}
+		}
+	}
+	l->pending = s;
+
+	LockAdvance(c, s);
+	if ((l->locked==1) && (s==l->origin) && (l->verified==1) &&
+			(c->published!=l->minute) &&
+			(PublishMinute(c, l->minute, "predicted")==0) &&
+			(StatsProtocol(l->radio)>=0))
+		c->stats->locked[StatsProtocol(l->radio)]++;
+
+	return;
+}
+
+
+/*
+ * The state carried over from the last run has been borne out by the second
+ * markers received since, so the seconds can be labeled from the lock once
+ * more without waiting for a minute to be decoded
+ */
+void WarmPass(struct clockInfo *c, time_t s)
+{
+	struct lockState *l = &c->lock;
+
+	if (l->locked==1) {
+		c->label = l->minute+(s-l->origin);
+		c->labeled.tv_sec = c->start.tv_sec;
+		c->labeled.tv_nsec = c->start.tv_nsec;
+	}
+
+	if (test==0)
+		syslog(LOG_INFO, "%s state carried over checks out%s", c->line,
+			(l->locked==1) ? ", still locked" : "");
+	else
+		fprintf(stdout, "%s state carried over checks out%s\n",
+			c->line, (l->locked==1) ? ", still locked" : "");
+
+	return;
+}
+
+
+/*
+ * Start the pulse width classes of a line from the fixed windows
+ */
+void WidthReset(struct clockInfo *c)
+{
+	struct widthClasses *w = &c->widths;
+	int k;
+
+	w->stretch = 0.0;
+	for (k=0;k<WIDTH_CLASSES;k++) {
+		w->own[k] = 0.0;
+		w->centre[k] = widthSeed[k];
+		w->spread[k] = (c->config.widthHalf/4.0)*
+			(c->config.widthHalf/4.0);
+		w->seen[k] = 0;
+		c->stats->width[k] = widthSeed[k];
+		c->stats->deviation[k] = c->config.widthHalf/4.0;
+	}
+
+	return;
+}
+
+
+/*
+ * Find the class of a pulse of the given width in ms, or of the gap before
+ * MSF bit B. Returns -1 if it is too far from every class to be any.
+ */
+int ClassifyWidth(struct clockInfo *c, double ms, int gap)
+{
+	struct widthClasses *w = &c->widths;
+	double d,half,nearest;
+	int k,best;
+
+	best = -1;
+	nearest = 0.0;
+	for (k=0;k<WIDTH_CLASSES;k++) {
+		if ((k==3)!=(gap==1))
+			continue;
+		d = fabs(ms-w->centre[k]);
+		half = 4.0*sqrt(w->spread[k]);
+		if ((half<c->config.widthHalf) || (k==3))
+			half = c->config.widthHalf;
+		else if (half>c->config.widthWidest)
+			half = c->config.widthWidest;
+		if ((d<half) && ((best<0) || (d<nearest))) {
+			best = k;
+			nearest = d;
+		}
+	}
+
+	return best;
+}
+
+
+/*
+ * Move the classes of pulse width towards a pulse put in one of them
+ */
+void LearnWidth(struct clockInfo *c, int k, double ms)
+{
+	struct widthClasses *w = &c->widths;
+	double d,gain,shift;
+	int i;
+
+	w->seen[k]++;
+	if (k==3)
+		return;
+
+	gain = c->config.widthGain;
+	shift = c->config.widthShift;
+	d = ms-w->centre[k];
+	w->spread[k] += ((d*d)-w->spread[k])/gain;
+	c->stats->deviation[k] = sqrt(w->spread[k]);
+
+	w->stretch += d/gain;
+	if (w->stretch>shift)
+		w->stretch = shift;
+	else if (w->stretch<-shift)
+		w->stretch = -shift;
+	w->own[k] += d/(4.0*gain);
+	if (w->own[k]>shift/2.0)
+		w->own[k] = shift/2.0;
+	else if (w->own[k]<-shift/2.0)
+		w->own[k] = -shift/2.0;
+
+	for (i=0;i<WIDTH_CLASSES;i++) {
+		if (i==3)
+			w->centre[i] = widthSeed[i]-w->stretch-w->own[0];
+		else
+			w->centre[i] = widthSeed[i]+w->stretch+w->own[i];
+		c->stats->width[i] = w->centre[i];
+	}
+
+	return;
+}
+
+
+/*
+ * Keep the width of the second marker just ended for the soft decoder
+ */
+void SoftPulse(struct clockInfo *c, struct timespec *length, time_t s)
+{
+	struct softFrame *f = &c->soft;
+	long width;
+	int i,k,best;
+
+	/* only the first pulse of a second is kept */
+	i = s%SOFT_SECONDS;
+	if (f->second[i]==s)
+		return;
+
+	/* the soft decoder expects the nominal widths, so take off how far
+	   the nearest class has moved */
+	width = (length->tv_sec*1000)+(length->tv_nsec/1000000);
+	if (length->tv_sec==0) {
+		for (k=1,best=0;k<WIDTH_CLASSES;k++)
+			if ((k!=3) && (fabs(width-c->widths.centre[k])<
+					fabs(width-c->widths.centre[best])))
+				best = k;
+		width -= lround(c->widths.centre[best]-widthSeed[best]);
+		if (width<0)
+			width = 0;
+	}
+	f->second[i] = s;
+	f->width[i] = (width>SOFT_MAX_WIDTH) ? SOFT_MAX_WIDTH : width;
+	f->extra[i] = 0;
+	f->last = i;
+
+	LockCheck(c, s);
+	if ((c->warm>0) && (--c->warm==0))
+		WarmPass(c, s);
+
+	return;
+}
+
+
+/*
+ * Note a second pulse in the second just kept, as sent for MSF bit B
+ */
+void SoftExtra(struct clockInfo *c)
+{
+	if (c->soft.last>=0)
+		c->soft.extra[c->soft.last] = 1;
+
+	return;
+}
+
+
+/*
+ * Soft decode the minute starting with the second marker just received,
+ * from the widths of the pulses over the last SOFT_SECONDS seconds. Every
+ * minute within SOFT_SKEW seconds of the system clock is tried by encoding
+ * the time code that would have been sent before it, and the most likely
+ * chosen. Returns the time of the minute, or -1 if no minute is a clear
+ * enough winner over the next most likely, giving the margin in confidence.
+ */
+time_t SoftDecode(struct clockInfo *c, int radio, double *confidence)
+{
+	signed char expect[SOFT_MINUTES][60];
+	time_t s0,s,u,base,first,last,m,best;
+	double ll,top,next;
+	int j,k,seen,agree;
+
+	/* the minutes that may be starting now, and those they draw on */
+	s0 = PulseSecond(c);
+	first = ((s0-SOFT_SKEW+59)/60)*60;
+	last = ((s0+SOFT_SKEW)/60)*60;
+	base = first-(((SOFT_SECONDS+59)/60)*60);
+
+	/* encode the time codes of all of the minutes */
+	for (m=base,j=0;m<=last;m+=60,j++)
+		SoftEncode(radio, m, expect[j]);
+
+	/* score each minute against the pulses seen */
+	best = -1;
+	top = next = -HUGE_VAL;
+	for (m=first;m<=last;m+=60) {
+		ll = 0.0;
+		for (s=s0-SOFT_SECONDS;s<s0;s++) {
+			u = s+m-s0;
+			k = expect[(u-base)/60][u%60];
+			if (k>=0)
+				ll += SoftScore(&c->soft, s, k);
+		}
+		if (ll>top) {
+			next = top;
+			top = ll;
+			best = m;
+		} else if (ll>next) {
+			next = ll;
+		}
+	}
+	*confidence = top-next;
+	if ((best<0) || (*confidence<SOFT_MARGIN))
+		return -1;
+
+	/* the winner must also match most of the pulses seen on its own */
+	seen = agree = 0;
+	for (s=s0-SOFT_SECONDS;s<s0;s++) {
+		u = s+best-s0;
+		k = expect[(u-base)/60][u%60];
+		if ((k<=0) || (c->soft.second[s%SOFT_SECONDS]!=s))
+			continue;
+		seen++;
+		agree += SoftMatch(&c->soft, s, k);
+	}
+	if ((seen<SOFT_SEEN) || (agree<seen*SOFT_AGREE))
+		return -1;
+
+	return best;
+}
+
+
+/*
+ * Process a received time code and place stamp into shared memory
+ */
+void ProcessTimeCode(struct clockInfo *c, int radio)
+{
+	struct lockState *l = &c->lock;
+	struct lineStats *st = c->stats;
+	time_t decoded,predicted,s0;
+	double confidence;
+	int i,k,soft,protocol;
+	uint64_t start;
+	char how[64];
+
+
+	start = MonotonicNow();
+	protocol = StatsProtocol(radio);
+	if (protocol>=0)
+		st->attempts[protocol]++;
+
+	/* decode the time, if a whole minute of pulses has been received */
+	decoded = DECODE_FORMAT;
+	switch (radio) {
+		case DCF77:
+			if (c->count>44)
+				decoded = DecodeDCF77(&c->bits);
+			break;
+		case MSF:
+			if (c->count>42)
+				decoded = DecodeMSF(&c->bits);
+			break;
+		case WWVB:
+			if (c->count>60)
+				decoded = DecodeWWVB(&c->bits);
+			break;
+		default:
+			decoded = DECODE_NONE;
+			break;
+	}
+	if (decoded==DECODE_FORMAT)
+		st->format++;
+	else if (decoded==DECODE_PARITY)
+		st->parity++;
+	else if (decoded==DECODE_RANGE)
+		st->sanity++;
+
+	/* otherwise weigh up the pulses of the last few minutes */
+	soft = 0;
+	if ((decoded<0) && (decoded!=DECODE_NONE)) {
+		decoded = SoftDecode(c, radio, &confidence);
+		soft = 1;
+	}
+
+	/* a decoded time that disagrees with the one locked on to is only
+	   believed if the pulses of the last few minutes bear it out */
+	s0 = PulseSecond(c);
+	if ((decoded>=0) && (l->locked==1) && (l->radio==radio) &&
+			((s0-l->origin)%60==0)) {
+		predicted = l->minute+(s0-l->origin);
+		if ((decoded!=predicted) && (SoftEvidence(c, radio, s0,
+				predicted)>=SoftEvidence(c, radio, s0, decoded))) {
+			if (test==1)
+				fprintf(stdout, "%s decoded time disagrees "
+					"with the locked time, ignored\n",
+					c->line);
+			decoded = -1;
+		} else if (decoded!=predicted) {
+			LockStart(c, radio, s0, decoded);
+		}
+	} else if (decoded>=0) {
+		LockStart(c, radio, s0, decoded);
+	}
+
+	/* keep what has been received if the minute could not be decoded, as
+	   the marker may have been a false one */
+	if (decoded<0) {
+		HistAdd(&c->latency[LATENCY_DECODE], MonotonicNow()-start);
+		return;
+	}
+
+	if (test==1) {
+		flockfile(stdout);
+		for (i=((c->count>64) ? 64 : c->count-1);i>0;i--) {
+			k = FrameSymbol(&c->bits, i-1);
+			if (k==SYMBOL_ERASED)
+				fputc('?', stdout);
+			else
+				fprintf(stdout, "%1d", k);
+		}
+		fprintf(stdout, "\n");
+		funlockfile(stdout);
+	}
+	if (soft==1)
+		st->soft[protocol]++;
+	else
+		st->decoded[protocol]++;
+	snprintf(how, sizeof(how), "soft decoded with confidence %.1f",
+		(soft==1) ? confidence : 0.0);
+	PublishMinute(c, decoded, (soft==1) ? how : NULL);
+
+	/* setup for receiving the next minute of pulses */
+	c->count = 1;
+	c->marker = 0x00;
+	c->frame = 0;
+	c->correct = 0;
+	HistAdd(&c->latency[LATENCY_DECODE], MonotonicNow()-start);
+
+	return;
+}
+
+
+/*
+ * Process a status change on the serial port to calculate the pulse type.
+ * If a minute marker is present send time stamp to ntpd.
+ */
+void ProcessStatusChange(struct clockInfo *c, int arg, struct timespec *ts)
+{
+	struct timespec length;
+	time_t second;
+	int k;
+
+	if ((!arg) && (c->status==1)) {
+		c->status = 0;
+		c->start.tv_sec = ts->tv_sec;
+		c->start.tv_nsec = ts->tv_nsec;
+
+		/* check for the DCF77 minute marker, timed from the end of the
+		   last second marker so a glitch in between does not hide it */
+		TimeSpecSub(&c->start, &c->ended, &length);
+		if ((length.tv_sec==1) && (length.tv_nsec>=760000000) &&
+				(length.tv_nsec<=950000000) && (OnPhase(c)==1) &&
+				(c->config.protocols & DCF77)) {
+			RecordPulse(c);
+			ProcessTimeCode(c, DCF77);
+			return;
+		}
+
+		/* check to see if bit B of the MSF code set, which can only
+		   follow a 100ms pulse */
+		TimeSpecSub(&c->start, &c->end, &length);
+		if ((length.tv_sec==0) && (FrameSymbol(&c->bits, 0)==0) &&
+				(ClassifyWidth(c, length.tv_nsec/1e6, 1)==3)) {
+			LearnWidth(c, 3, length.tv_nsec/1e6);
+			SetSymbol(&c->bits, 3);
+			c->stats->pulses[3]++;
+			SoftExtra(c);
+			c->correct = 1;
+		}
+
+	} else if ((arg) && (c->status==0)) {
+		c->status = 1;
+		c->end.tv_sec = ts->tv_sec;
+		c->end.tv_nsec = ts->tv_nsec;
+		TimeSpecSub(&c->end, &c->start, &length);
+
+		if (c->correct==1) {
+			/* make a correction for MSF bit B being set */
+			c->correct = 0;
+			return;
+		}
+
+		/* pulses that do not start on a second are ignored, as is any
+		   but the first in a second */
+		if (SecondMarker(c, &second)==0)
+			return;
+		SoftPulse(c, &length, second);
+		if (second==c->second)
+			return;
+		AlignFrame(c, second);
+		c->ended.tv_sec = c->end.tv_sec;
+		c->ended.tv_nsec = c->end.tv_nsec;
+
+		/* a pulse of unknown length, or too long to be any, erases the
+		   second rather than losing the rest of the minute */
+		k = (length.tv_sec==0) ? ClassifyWidth(c, length.tv_nsec/1e6,
+			0) : -1;
+		if (k>=0)
+			LearnWidth(c, k, length.tv_nsec/1e6);
+
+		if (k<0) {
+			PushSymbol(&c->bits, SYMBOL_ERASED);
+			c->stats->pulses[STATS_UNKNOWN]++;
+			c->stats->erasures++;
+			c->count++;
+			c->frame = 0;
+			c->marker = c->marker<<1;
+		} else if (k==0) {
+			PushSymbol(&c->bits, 0);
+			c->stats->pulses[0]++;
+			RecordPulse(c);
+			c->count++;
+			c->frame = 0;
+			c->marker = c->marker<<1;
+		} else if (k==1) {
+			PushSymbol(&c->bits, 1);
+			c->stats->pulses[1]++;
+			RecordPulse(c);
+			c->count++;
+			c->frame = 0;
+			c->marker = (c->marker<<1) | 1;
+		} else if (k==2) {
+			PushSymbol(&c->bits, 2);
+			c->stats->pulses[2]++;
+			RecordPulse(c);
+			c->count++;
+			c->frame = 0;
+			c->marker = (c->marker<<1) | 1;
+		} else if (k==4) {
+			PushSymbol(&c->bits, 4);
+			c->stats->pulses[4]++;
+			RecordPulse(c);
+			c->count++;
+			c->frame = 0;
+			/* check for MSF minute marker */
+			if ((c->marker==0x7e) && (c->config.protocols & MSF)) {
+				ProcessTimeCode(c, MSF);
+				return;
+			}
+		} else {
+			PushSymbol(&c->bits, 5);
+			c->stats->pulses[5]++;
+			RecordPulse(c);
+			c->count++;
+			c->frame++;
+			/* check for the WWVB minute marker */
+			if ((c->frame==2) && (c->config.protocols & WWVB)) {
+				ProcessTimeCode(c, WWVB);
+				return;
+			}
+		}
+
+	}
+
+	/* only the last 64 seconds are kept in the frame */
+	if (c->count>64)
+		c->count = 64;
+
+	return;
+}
+
+
+/*
+ * Catch any signals sent, and exit cleanly.
+ */
+void Catch(int sig)
+{
+	int i,j;
+
+	if (test==0) {
+		syslog(LOG_INFO, "Exiting...");
+		unlink(PID_FILE);
+		munlockall();
+	} else {
+		fprintf(stderr, "radioclkd: Exiting...\n" );
+	}
+	for (i=0;i<nports;i++) {
+		LogCounters(&ports[i]);
+		for (j=0;j<3;j++) {
+			if ((test==0) && (ports[i].line[j].stamp!=NULL))
+				shmdt(ports[i].line[j].stamp);
+			ClosePPS(&ports[i].line[j], ports[i].fd);
+			if (ports[i].line[j].sockfd>=0)
+				close(ports[i].line[j].sockfd);
+		}
+		if (ports[i].record!=NULL)
+			fclose(ports[i].record);
+		close(ports[i].fd);
+	}
+
+	exit(0);
+}
+
+
+/*
+ * Open a serial port, lock it against other copies of radioclkd and power up
+ * the receiver(s) attached to it.
+ */
+int OpenPort(struct portInfo *p)
+{
+	if ((p->fd = open(p->devname, O_RDWR | O_NOCTTY | O_NDELAY))<0) {
+		fprintf(stderr, "radioclkd: couldn't open device %s\n",
+			p->devname);
+		return -1;
+	}
+
+	if (flock(p->fd, LOCK_EX | LOCK_NB)!=0) {
+		fprintf(stderr, "radioclkd: device %s is already in use\n",
+			p->devname);
+		close(p->fd);
+		return -1;
+	}
+
+	if (TurnReceiverOn(p->fd)!=0) {
+		fprintf(stderr, "radioclkd: error powering up receiver on %s\n",
+			p->devname);
+		close(p->fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Wait for the receivers to power up, until a whole pulse has been seen on
+ * one of the lines of every serial port or POWER_UP_WAIT seconds have
+ * passed, so no more time than needed is lost before edges are captured
+ */
+void WaitForReceivers(void)
+{
+	struct timespec next;
+	int i,j,n,ready,status;
+	int last[MAX_PORTS],changes[MAX_PORTS][3];
+
+	for (i=0;i<nports;i++) {
+		if (ioctl(ports[i].fd, TIOCMGET, &last[i])!=0)
+			last[i] = 0;
+		for (j=0;j<3;j++)
+			changes[i][j] = 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (n=0;n<(POWER_UP_WAIT*1000000000L)/POWER_UP_POLL;n++) {
+		TimeSpecAdd(&next, POWER_UP_POLL);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		/* a line that has changed twice has sent a pulse */
+		for (i=0,ready=0;i<nports;i++) {
+			if (ioctl(ports[i].fd, TIOCMGET, &status)!=0)
+				continue;
+			for (j=0;j<3;j++)
+				if ((status^last[i]) & lineMask[j])
+					changes[i][j]++;
+			last[i] = status;
+			for (j=0;j<3;j++)
+				if (changes[i][j]>=2)
+					break;
+			if (j<3)
+				ready++;
+		}
+		if (ready==nports)
+			return;
+	}
+
+	return;
+}
+
+
+/*
+ * Let go of the SHM segment and chrony socket of a line, the new ones being
+ * attached to when the next time stamp is published
+ */
+void ReleaseOutput(struct clockInfo *c)
+{
+	if ((replay==0) && (c->stamp!=NULL))
+		shmdt(c->stamp);
+	c->stamp = NULL;
+	c->ring = NULL;
+	if (c->sockfd>=0)
+		close(c->sockfd);
+	c->sockfd = -1;
+	c->sockerror = 0;
+
+	return;
+}
+
+
+/*
+ * Change the settings of a running line to those read again from the
+ * configuration file, keeping what has been received, the lock and the
+ * tracking filter
+ */
+void ApplyLineConfig(struct clockInfo *c, struct lineConfig *lc)
+{
+	int radio;
+
+	if ((lc->unit!=c->config.unit) || strcmp(lc->chrony, c->config.chrony))
+		ReleaseOutput(c);
+	if (lc->average!=c->config.average)
+		WindowResize(&c->offsets, lc->average);
+	c->config = *lc;
+	c->unit = lc->unit;
+	c->stats->unit = lc->unit;
+
+	/* work out the delay again for the transmitter being received */
+	radio = c->radio;
+	c->radio = 0;
+	c->delay = c->config.delay;
+	if (radio!=0)
+		SetTransmitter(c, radio);
+	StatsPublish(c);
+
+	return;
+}
+
+
+/*
+ * Initialize the clock structures for the lines of a serial port. Unless the
+ * configuration file says otherwise each line is given its own SHM unit,
+ * three per port in the order given on the command line.
+ */
+void InitPort(struct portInfo *p, int index)
+{
+	int i;
+	struct clockInfo *c;
+
+	p->state = -1;
+	p->captured = 0;
+	memset(p->latency, 0, sizeof(p->latency));
+	memset(p->phase, 0, sizeof(p->phase));
+	SoftInit();
+	for (i=0;i<3;i++) {
+		c = &p->line[i];
+		memset(c, 0, sizeof(struct clockInfo));
+		c->count = 1;
+		c->last = -1;
+		c->label = -1;
+		c->precision = PRECISION;
+		c->soft.last = -1;
+		c->published = -1;
+		c->config = p->config[i];
+		if (c->config.unit<0)
+			c->config.unit = (index*3)+i;
+		c->unit = c->config.unit;
+		c->ppsfd = -1;
+		c->sockfd = -1;
+		c->delay = c->config.delay;
+		WindowReset(&c->offsets, c->config.average);
+		snprintf(c->line, sizeof(c->line), "%s %s", p->name,
+			lineName[i]);
+		c->latency = p->latency;
+		c->stats = &c->ownStats;
+		c->shared = NULL;
+		c->stats->unit = c->unit;
+		snprintf(c->stats->name, sizeof(c->stats->name), "%s",
+			c->line);
+		WidthReset(c);
+	}
+
+	/* the kernel PPS line discipline only time stamps the DCD line */
+	if ((p->kernelpps==1) && (OpenPPS(&p->line[0], p->fd, p->devname)!=0)) {
+		if (test==0)
+			syslog(LOG_INFO, "unable to use kernel PPS for %s, "
+				"falling back to user space time stamps",
+				p->line[0].line);
+		else
+			fprintf(stderr, "radioclkd: unable to use kernel PPS "
+				"for %s\n", p->line[0].line);
+	}
+
+	return;
+}
+
+
+/*
+ * Map the state file, keeping a copy of the state saved in it by the last
+ * run before it is written over. A file of some other layout is started
+ * afresh.
+ */
+int MapState(char *file)
+{
+	struct stateFile *s;
+	struct stat st;
+	int fd,kept;
+
+	if ((fd = open(file, O_RDWR | O_CREAT, 0644))<0)
+		return -1;
+	if (fstat(fd, &st)!=0) {
+		close(fd);
+		return -1;
+	}
+	kept = (st.st_size==sizeof(struct stateFile));
+	if ((kept==0) && (ftruncate(fd, sizeof(struct stateFile))!=0)) {
+		close(fd);
+		return -1;
+	}
+
+	s = (struct stateFile *) mmap(NULL, sizeof(struct stateFile),
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s==MAP_FAILED)
+		return -1;
+
+	if ((kept==1) && (!memcmp(s->magic, STATE_MAGIC, 8)) &&
+			(s->version==STATE_VERSION) &&
+			(s->size==sizeof(struct stateFile)))
+		memcpy(carried, s->line, sizeof(carried));
+	memset(s, 0, sizeof(struct stateFile));
+	memcpy(s->magic, STATE_MAGIC, 8);
+	s->version = STATE_VERSION;
+	s->size = sizeof(struct stateFile);
+	state = s;
+
+	return 0;
+}
+
+
+/*
+ * Give a line its slot in the state file, and carry on from the state saved
+ * for it by the last run. The widths of the pulses belong to the receiver and
+ * are kept however old they are, the rest only if it was saved within the
+ * hour, and then only until the first few second markers fail to bear it out.
+ */
+void RestoreState(struct clockInfo *c, int slot)
+{
+	struct savedLine *s;
+	time_t now;
+	int i,k;
+
+	c->saved = &state->line[slot];
+	snprintf(c->saved->name, sizeof(c->saved->name), "%s", c->line);
+
+	for (i=0;i<MAX_PORTS*3;i++)
+		if ((carried[i].saved>0) && (carried[i].seq%2==0) &&
+				(!strcmp(carried[i].name, c->line)))
+			break;
+	if (i==MAX_PORTS*3)
+		return;
+	s = &carried[i];
+
+	c->widths = s->widths;
+	for (k=0;k<WIDTH_CLASSES;k++) {
+		c->stats->width[k] = c->widths.centre[k];
+		c->stats->deviation[k] = sqrt(c->widths.spread[k]);
+	}
+
+	now = time(NULL);
+	if ((now<s->saved) || (now-s->saved>LOCK_GAP)) {
+		if (test==0)
+			syslog(LOG_INFO, "%s carrying over the pulse widths "
+				"only", c->line);
+		else
+			fprintf(stdout, "%s carrying over the pulse widths "
+				"only\n", c->line);
+		return;
+	}
+
+	c->phase = s->phase;
+	c->phaseHits = s->phaseHits;
+	c->last = s->last;
+	c->published = s->published;
+	c->stats->lastFix = (s->last>0) ? s->last : 0;
+	c->filter = s->filter;
+	if (s->lock.locked==1) {
+		c->lock = s->lock;
+		c->lock.pending = -1;
+		c->lock.good = 0;
+		c->lock.errors = 0;
+		c->lock.bad = 0;
+		c->lock.verified = 0;
+		SetTransmitter(c, c->lock.radio);
+	}
+	c->warm = WARM_SECONDS;
+	c->warmErrors = 0;
+
+	if (test==0)
+		syslog(LOG_INFO, "%s carrying on from the state saved %lds ago%s",
+			c->line, (long) (now-s->saved),
+			(s->lock.locked==1) ? ", locked" : "");
+	else
+		fprintf(stdout, "%s carrying on from the state saved %lds "
+			"ago%s\n", c->line, (long) (now-s->saved),
+			(s->lock.locked==1) ? ", locked" : "");
+
+	return;
+}
+
+
+/*
+ * Open the file the edges on a serial port are recorded to, appending to any
+ * existing recording
+ */
+int OpenRecording(struct portInfo *p, char *dir)
+{
+	char path[256];
+	struct recordHeader header;
+
+	snprintf(path, sizeof(path), "%s/%s.edges", dir, p->name);
+	if (!(p->record = fopen(path, "a"))) {
+		fprintf(stderr, "radioclkd: couldn't open recording %s\n", path);
+		return -1;
+	}
+
+	if (ftell(p->record)==0) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+		header.version = RECORD_VERSION;
+		header.size = sizeof(struct edgeRecord);
+		fwrite(&header, sizeof(header), 1, p->record);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Write an edge to the recording
+ */
+void WriteEdgeRecord(FILE *str, int status, struct timespec *ts)
+{
+	struct edgeRecord r;
+
+	r.sec = ts->tv_sec;
+	r.nsec = ts->tv_nsec;
+	r.status = status;
+	fwrite(&r, sizeof(r), 1, str);
+
+	return;
+}
+
+
+/*
+ * Record the edges on a serial port. Lines with a kernel PPS time stamp get
+ * a record of their own at that time, so a replay sees exactly the time
+ * stamps the lines were processed with.
+ */
+void RecordEdges(struct portInfo *p, int arg, struct timespec *ts,
+	struct timespec *edge)
+{
+	int i;
+
+	for (i=0;i<3;i++) {
+		if ((edge[i].tv_sec==ts->tv_sec) &&
+				(edge[i].tv_nsec==ts->tv_nsec))
+			continue;
+		p->recorded = (p->recorded & ~lineMask[i]) | (arg & lineMask[i]);
+		WriteEdgeRecord(p->record, p->recorded, &edge[i]);
+	}
+	WriteEdgeRecord(p->record, arg, ts);
+	p->recorded = arg;
+
+	return;
+}
+
+
+/*
+ * Take the kernel PPS time stamps of the lines of a serial port that changed
+ * state, which must be done before the next edge
+ */
+void CaptureEdge(struct portInfo *p, int arg, struct timespec *ts,
+	struct timespec *edge)
+{
+	struct timespec late;
+	int i;
+
+	for (i=0;i<3;i++) {
+		edge[i] = *ts;
+		if ((arg ^ p->captured) & lineMask[i])
+			CountAdd(&p->counters.fetches, FetchPPSTimeStamp(
+				&p->line[i], (arg & lineMask[i]), ts, &edge[i]));
+
+		/* the kernel time stamp is taken in the interrupt handler, so
+		   gives the latency of our time stamp */
+		if ((edge[i].tv_sec!=ts->tv_sec) ||
+				(edge[i].tv_nsec!=ts->tv_nsec)) {
+			TimeSpecSub(ts, &edge[i], &late);
+			if (late.tv_sec==0)
+				HistAdd(&p->latency[LATENCY_IRQ], late.tv_nsec);
+		}
+	}
+	p->captured = arg;
+
+	return;
+}
+
+
+/*
+ * Process a status change on a serial port for the clocks on all its lines
+ */
+void HandleEdge(struct portInfo *p, int arg, struct timespec *ts,
+	struct timespec *edge)
+{
+	uint64_t start;
+	int i,changed;
+
+	if (p->record!=NULL)
+		RecordEdges(p, arg, ts, edge);
+
+	/* process any clock on the DCD, CTS and DSR status lines, bar those
+	   turned off */
+	for (i=0;i<3;i++) {
+		if (p->line[i].config.protocols==0)
+			continue;
+		changed = ((arg & lineMask[i]) ? 1 : 0)!=p->line[i].status;
+		start = MonotonicNow();
+		ProcessStatusChange(&p->line[i], (arg & lineMask[i]), &edge[i]);
+		StatsPublish(&p->line[i]);
+		if (changed)
+			HistAdd(&p->latency[LATENCY_EDGE], MonotonicNow()-start);
+	}
+
+	/* print pulse information on stdout if in test mode */
+	if ((test==1) && ((p->line[0].status==1) ||
+			(p->line[1].status==1) || (p->line[2].status==1))) {
+		flockfile(stdout);
+		for (i=0;i<3;i++)
+			PrintPulseInfo(&p->line[i]);
+		fprintf(stdout, "\n");
+		funlockfile(stdout);
+	}
+
+	/* warn if valid time stamp not received in the last 5 mins */
+	for (i=0;i<3;i++)
+		if (p->line[i].config.protocols!=0)
+			LogNoSignalWarning(&p->line[i], ts->tv_sec);
+
+	return;
+}
+
+
+/*
+ * Capture and process a status change on a serial port in one go, when
+ * replaying or generating edges
+ */
+void ProcessEdge(struct portInfo *p, int arg, struct timespec *ts)
+{
+	struct timespec edge[3];
+
+	CaptureEdge(p, arg, ts, edge);
+	HandleEdge(p, arg, ts, edge);
+
+	return;
+}
+
+
+/*
+ * Capture thread for a serial port, loops until we die. It runs at real time
+ * priority and only time stamps the edges, everything else being left to the
+ * worker thread so nothing can hold up the capture of the next edge.
+ */
+void *CapturePort(void *data)
+{
+	struct portInfo *p = (struct portInfo *) data;
+	struct timespec ts,edge[3];
+	struct timespec retry = { SERIAL_RETRY, 0 };
+	int arg;
+
+
+	for (;;) {
+		arg = WaitOnSerialChange(p, &ts);
+		CountAdd(&p->wakeups, 1);
+
+		/* a port that has gone away is tried again only after a pause,
+		   so the thread does not spin at real time priority */
+		if (arg==SERIAL_FAILED) {
+			if (p->failed==0) {
+				if (test==0)
+					syslog(LOG_ERR, "%s: unable to read the "
+						"serial port: %m", p->name);
+				else
+					fprintf(stderr, "radioclkd: %s: unable "
+						"to read the serial port: %s\n",
+						p->name, strerror(errno));
+				p->failed = 1;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, 0, &retry, NULL);
+			arg = -1;
+		} else if ((arg!=-1) && (p->failed==1)) {
+			if (test==0)
+				syslog(LOG_NOTICE, "%s: serial port readable "
+					"again", p->name);
+			else
+				fprintf(stderr, "radioclkd: %s: serial port "
+					"readable again\n", p->name);
+			p->failed = 0;
+		}
+
+		/* on a time out the worker only checks for a lost signal */
+		if (arg==-1) {
+			CountAdd(&p->counters.timeouts, 1);
+			clock_gettime(CLOCK_REALTIME, &ts);
+			QueueEdge(p, -1, &ts, NULL);
+			continue;
+		}
+		CountAdd(&p->counters.edges, 1);
+		CaptureEdge(p, arg, &ts, edge);
+		QueueEdge(p, arg, &ts, edge);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Worker thread for a serial port, decodes the edges queued by its capture
+ * thread at normal priority, loops until we die
+ */
+void *ProcessPort(void *data)
+{
+	struct portInfo *p = (struct portInfo *) data;
+	struct edgeEvent e;
+	uint64_t n;
+	int i;
+
+
+	for (;;) {
+		if ((read(p->queue.fd, &n, sizeof(n))<0) && (errno!=EINTR))
+			return NULL;
+
+		/* settings read again on SIGHUP are changed between edges */
+		if (__atomic_load_n(&p->reloading, __ATOMIC_ACQUIRE)==1) {
+			for (i=0;i<3;i++)
+				ApplyLineConfig(&p->line[i], &p->reload[i]);
+			__atomic_store_n(&p->reloading, 0, __ATOMIC_RELEASE);
+		}
+
+		while (DequeueEdge(p, &e)==0) {
+			if (e.status==-1) {
+				for (i=0;i<3;i++)
+					LogNoSignalWarning(&p->line[i],
+						e.ts.tv_sec);
+				continue;
+			}
+			HistAdd(&p->latency[LATENCY_QUEUE], MonotonicNow()-
+				e.queued);
+			HandleEdge(p, e.status, &e.ts, e.edge);
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Called once a second from the main loop, wake any capture thread that has
+ * been stuck in TIOCMIWAIT for too long so it can check for a lost signal,
+ * and keep waking it each second until it does.
+ */
+void SerialWatchdog(void)
+{
+	int i;
+	unsigned long wakeups;
+	struct portInfo *p;
+
+	for (i=0;i<nports;i++) {
+		p = &ports[i];
+		wakeups = CountGet(&p->wakeups);
+		if (wakeups!=p->idle) {
+			p->idle = wakeups;
+			p->timeout = 0;
+		} else if ((p->poll==0) && (++p->timeout>=SERIAL_TIMEOUT)) {
+			/* the signal is lost if the thread was not yet in
+			   TIOCMIWAIT, so it is sent every second until the
+			   thread wakes */
+			pthread_kill(p->thread, SIGALRM);
+		}
+	}
+
+	return;
+}
+
+
+/*
+ * The absolute path of a file that is written after we have changed
+ * directory to /, found from the directory it is in, which must exist.
+ * Returns NULL if it does not.
+ */
+char *AbsolutePath(char *file)
+{
+	char *copy,*dir,*base,*resolved,*path;
+	size_t length;
+
+	if ((copy = strdup(file))==NULL)
+		return NULL;
+	if ((base = strrchr(copy, '/'))==NULL) {
+		dir = ".";
+		base = copy;
+	} else if (base==copy) {
+		dir = "/";
+		base++;
+	} else {
+		*base++ = '\0';
+		dir = copy;
+	}
+
+	path = NULL;
+	if ((*base!='\0') && ((resolved = realpath(dir, NULL))!=NULL)) {
+		length = strlen(resolved)+strlen(base)+2;
+		if ((path = (char *) malloc(length))!=NULL)
+			snprintf(path, length, "%s/%s", (strcmp(resolved, "/")) ?
+				resolved : "", base);
+		free(resolved);
+	}
+	free(copy);
+
+	return path;
+}
+
+
+/*
+ * Parse a location given as the latitude and longitude in degrees, north and
+ * east being positive
+ */
+int ParseLocation(char *arg, double *latitude, double *longitude)
+{
+	char *next;
+
+	*latitude = strtod(arg, &next);
+	if ((next==arg) || (*next!=','))
+		return -1;
+	arg = next+1;
+	*longitude = strtod(arg, &next);
+	if ((next==arg) || (*next!='\0'))
+		return -1;
+
+	if ((fabs(*latitude)>90.0) || (fabs(*longitude)>180.0))
+		return -1;
+
+	return 0;
+}
+
+
+/*
+ * Parse the delays in ms of the receivers on the DCD, CTS and DSR lines,
+ * either one for all three or one for each, into ns
+ */
+int ParseDelays(char *arg, long *delay)
+{
+	char *next;
+	double ms;
+	int n;
+
+	for (n=0;n<3;n++) {
+		ms = strtod(arg, &next);
+		if ((next==arg) || (ms<0.0) || (ms>=1000.0))
+			return -1;
+		delay[n] = lround(ms*1e6);
+		if (*next=='\0')
+			break;
+		if ((*next!=',') || (n==2))
+			return -1;
+		arg = next+1;
+	}
+
+	if (n==0)
+		delay[1] = delay[2] = delay[0];
+	else if (n!=2)
+		return -1;
+
+	return 0;
+}
+
+
+/*
+ * The settings of a line when nothing else is given
+ */
+void DefaultLineConfig(struct lineConfig *lc)
+{
+	memset(lc, 0, sizeof(struct lineConfig));
+	lc->protocols = DCF77 | MSF | WWVB;
+	lc->unit = -1;
+	lc->average = averageWindow;
+	lc->widthHalf = WIDTH_HALF;
+	lc->widthWidest = WIDTH_WIDEST;
+	lc->widthGain = WIDTH_GAIN;
+	lc->widthShift = WIDTH_SHIFT;
+
+	return;
+}
+
+
+/*
+ * Parse a number that must lie between lo and hi
+ */
+int ParseNumber(char *arg, double lo, double hi, double *x)
+{
+	char *next;
+
+	*x = strtod(arg, &next);
+	if ((next==arg) || (*next!='\0') || (*x<lo) || (*x>hi))
+		return -1;
+
+	return 0;
+}
+
+
+/*
+ * Set one of the settings of a line from the configuration file. Returns 0
+ * if the key is not one for a line and -1 if the value is wrong.
+ */
+int SetLineOption(struct lineConfig *lc, char *key, char *value)
+{
+	char list[64],*name;
+	double x;
+
+	if (!strcmp(key, "protocol")) {
+		lc->protocols = 0;
+		if (!strcmp(value, "any")) {
+			lc->protocols = DCF77 | MSF | WWVB;
+			return 1;
+		} else if (!strcmp(value, "off")) {
+			return 1;
+		}
+		snprintf(list, sizeof(list), "%s", value);
+		for (name=strtok(list, ",");name!=NULL;name=strtok(NULL, ",")) {
+			if (!strcasecmp(name, "dcf77"))
+				lc->protocols |= DCF77;
+			else if (!strcasecmp(name, "msf"))
+				lc->protocols |= MSF;
+			else if (!strcasecmp(name, "wwvb"))
+				lc->protocols |= WWVB;
+			else
+				return -1;
+		}
+	} else if (!strcmp(key, "unit")) {
+		if (ParseNumber(value, 0, 255, &x)!=0)
+			return -1;
+		lc->unit = (int) x;
+	} else if (!strcmp(key, "average")) {
+		if (ParseNumber(value, 1, WINDOW_MAX, &x)!=0)
+			return -1;
+		lc->average = (int) x;
+	} else if (!strcmp(key, "delay")) {
+		if (ParseNumber(value, 0.0, 999.999, &x)!=0)
+			return -1;
+		lc->delay = lround(x*1e6);
+	} else if (!strcmp(key, "location")) {
+		if (ParseLocation(value, &lc->latitude, &lc->longitude)!=0)
+			return -1;
+		lc->located = 1;
+	} else if (!strcmp(key, "output")) {
+		if (!strcmp(value, "shm"))
+			lc->chrony[0] = '\0';
+		else if ((value[0]=='/') && (strlen(value)<SOCKET_PATH))
+			strcpy(lc->chrony, value);
+		else
+			return -1;
+	} else if (!strcmp(key, "width-half")) {
+		if (ParseNumber(value, 5.0, 100.0, &lc->widthHalf)!=0)
+			return -1;
+	} else if (!strcmp(key, "width-widest")) {
+		if (ParseNumber(value, 5.0, 100.0, &lc->widthWidest)!=0)
+			return -1;
+	} else if (!strcmp(key, "width-gain")) {
+		if (ParseNumber(value, 1.0, 1024.0, &lc->widthGain)!=0)
+			return -1;
+	} else if (!strcmp(key, "width-shift")) {
+		if (ParseNumber(value, 0.0, 100.0, &lc->widthShift)!=0)
+			return -1;
+	} else {
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/*
+ * Set one of the settings of a port, or the global settings, from the
+ * configuration file. Returns 0 if the key is not one of them and -1 if the
+ * value is wrong.
+ */
+int SetPortOption(struct portConfig *port, char *key, char *value)
+{
+	int *flag;
+
+	if (!strcmp(key, "record")) {
+		if (strlen(value)>=sizeof(port->recorddir))
+			return -1;
+		strcpy(port->recorddir, value);
+		return 1;
+	}
+
+	if (!strcmp(key, "poll"))
+		flag = &port->poll;
+	else if (!strcmp(key, "kernel-pps"))
+		flag = &port->kernelpps;
+	else
+		return 0;
+
+	if (!strcmp(value, "yes"))
+		*flag = 1;
+	else if (!strcmp(value, "no"))
+		*flag = 0;
+	else
+		return -1;
+
+	return 1;
+}
+
+int SetGlobalOption(struct config *cfg, char *key, char *value)
+{
+	double x;
+
+	if (!strcmp(key, "errors")) {
+		if (ParseNumber(value, 0, 59, &x)!=0)
+			return -1;
+		cfg->errors = (int) x;
+	} else if (!strcmp(key, "seconds")) {
+		if (!strcmp(value, "off"))
+			cfg->seconds = PER_SECOND_OFF;
+		else if (!strcmp(value, "raw"))
+			cfg->seconds = PER_SECOND_RAW;
+		else if (!strcmp(value, "mean"))
+			cfg->seconds = PER_SECOND_MEAN;
+		else
+			return -1;
+	} else if (!strcmp(key, "latency")) {
+		/* the file is read again after changing directory to / */
+		if ((value[0]!='/') || (strlen(value)+5>=sizeof(cfg->latency)))
+			return -1;
+		strcpy(cfg->latency, value);
+	} else if (!strcmp(key, "state")) {
+		if (strlen(value)>=sizeof(cfg->state))
+			return -1;
+		strcpy(cfg->state, value);
+	} else {
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/*
+ * Read the configuration file. Each line is a key and a value, with # to
+ * the end of the line a comment. Settings before the first port are global
+ * or the defaults of every line, those following a port apply to it and
+ * all of its lines, and those following a line to that line alone. Returns
+ * -1 with the reason in error if the file cannot be read or is wrong.
+ */
+int LoadConfig(char *file, struct config *cfg, char *error, size_t size)
+{
+	struct lineConfig defaults,*lc;
+	struct portConfig *port;
+	char buffer[512],*key,*value,*end;
+	int i,k,number;
+	FILE *str;
+
+	if (!(str = fopen(file, "r"))) {
+		snprintf(error, size, "couldn't open configuration file %s",
+			file);
+		return -1;
+	}
+
+	memset(cfg, 0, sizeof(struct config));
+	cfg->errors = -1;
+	cfg->seconds = -1;
+	DefaultLineConfig(&defaults);
+	port = NULL;
+	lc = NULL;
+	number = 0;
+	while (fgets(buffer, sizeof(buffer), str)!=NULL) {
+		number++;
+		if ((end = strchr(buffer, '#'))!=NULL)
+			*end = '\0';
+		if ((key = strtok(buffer, " \t\r\n"))==NULL)
+			continue;
+		value = strtok(NULL, " \t\r\n");
+		if ((value==NULL) || (strtok(NULL, " \t\r\n")!=NULL)) {
+			snprintf(error, size, "%s:%d: %s takes one value", file,
+				number, key);
+			fclose(str);
+			return -1;
+		}
+
+		/* a new port starts with the defaults for its lines */
+		if (!strcmp(key, "port")) {
+			if (cfg->nports==MAX_PORTS) {
+				snprintf(error, size, "%s:%d: at most %d serial "
+					"ports can be used", file, number,
+					MAX_PORTS);
+				fclose(str);
+				return -1;
+			}
+			port = &cfg->port[cfg->nports++];
+			if (value[0]=='/')
+				snprintf(port->devname, sizeof(port->devname),
+					"%s", value);
+			else
+				snprintf(port->devname, sizeof(port->devname),
+					"/dev/%s", value);
+			for (i=0;i<3;i++)
+				port->line[i] = defaults;
+			lc = NULL;
+			continue;
+		}
+
+		if (!strcmp(key, "line")) {
+			for (i=0;i<3;i++)
+				if (!strcasecmp(value, lineName[i]))
+					break;
+			if ((port==NULL) || (i==3)) {
+				snprintf(error, size, "%s:%d: no line %s",
+					file, number, value);
+				fclose(str);
+				return -1;
+			}
+			lc = &port->line[i];
+			continue;
+		}
+
+		if (port==NULL) {
+			if ((k = SetLineOption(&defaults, key, value))==0)
+				k = SetGlobalOption(cfg, key, value);
+		} else if (lc!=NULL) {
+			k = SetLineOption(lc, key, value);
+		} else {
+			for (i=0;i<3;i++)
+				k = SetLineOption(&port->line[i], key, value);
+			if (k==0)
+				k = SetPortOption(port, key, value);
+		}
+		if (k!=1) {
+			snprintf(error, size, "%s:%d: %s %s %s", file, number,
+				(k==0) ? "unknown setting" : "invalid", key,
+				value);
+			fclose(str);
+			return -1;
+		}
+	}
+	fclose(str);
+
+	return 0;
+}
+
+
+/*
+ * Check that no two lines send their time stamps to the same unit, the
+ * default units being three for each port in turn
+ */
+int CheckUnits(struct lineConfig lines[][3], int n)
+{
+	int i,j,unit;
+	unsigned char used[256];
+
+	memset(used, 0, sizeof(used));
+	for (i=0;i<n;i++) {
+		for (j=0;j<3;j++) {
+			unit = (lines[i][j].unit<0) ? (i*3)+j : lines[i][j].unit;
+			if (used[unit]++>0)
+				return unit;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * Add the serial ports in the configuration file to those to be used, and
+ * take the global settings from it
+ */
+int AddConfigPorts(struct config *cfg)
+{
+	struct portConfig *port;
+	struct portInfo *p;
+	int i,j;
+
+	for (i=0;i<cfg->nports;i++) {
+		port = &cfg->port[i];
+		for (j=0;j<nports;j++) {
+			if (!strcmp(ports[j].devname, port->devname)) {
+				fprintf(stderr, "radioclkd: error %s is given "
+					"more than once\n", port->devname);
+				return -1;
+			}
+		}
+		if (nports==MAX_PORTS) {
+			fprintf(stderr, "radioclkd: error at most %d serial "
+				"ports can be used\n", MAX_PORTS);
+			return -1;
+		}
+		p = &ports[nports++];
+		strcpy(p->devname, port->devname);
+		p->name = strrchr(p->devname, '/')+1;
+		p->poll = port->poll;
+		p->kernelpps = port->kernelpps;
+		p->recorddir = (port->recorddir[0]!='\0') ? port->recorddir :
+			NULL;
+		for (j=0;j<3;j++)
+			p->config[j] = port->line[j];
+	}
+
+	if (cfg->errors>=0)
+		lockErrors = cfg->errors;
+	if (cfg->seconds>=0)
+		perSecond = cfg->seconds;
+	if (cfg->latency[0]!='\0')
+		latencyFile = cfg->latency;
+	if (cfg->state[0]!='\0')
+		stateFile = cfg->state;
+
+	return 0;
+}
+
+
+/*
+ * Report how reading the configuration again went, to syslog or in test
+ * mode stderr
+ */
+void ReloadMessage(const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	if (test==0) {
+		vsyslog(LOG_INFO, format, ap);
+	} else {
+		fprintf(stderr, "radioclkd: ");
+		vfprintf(stderr, format, ap);
+		fprintf(stderr, "\n");
+	}
+	va_end(ap);
+
+	return;
+}
+
+
+/*
+ * Read the configuration file again on SIGHUP, and hand the new settings of
+ * each line to the worker thread of its port to change between edges, so
+ * that nothing received so far is lost. Ports not in the file keep their
+ * settings, and those that can only be set at start up are left alone.
+ */
+void ReloadConfig(void)
+{
+	static struct config staged;
+	struct lineConfig lines[MAX_PORTS][3];
+	struct portConfig *port;
+	struct portInfo *p;
+	char error[256];
+	uint64_t one = 1;
+	int i,j,k;
+
+	if (configFile==NULL) {
+		ReloadMessage("no configuration file to read again");
+		return;
+	}
+	if (LoadConfig(configFile, &staged, error, sizeof(error))!=0) {
+		ReloadMessage("%s, keeping the old configuration", error);
+		return;
+	}
+
+	for (i=0;i<nports;i++) {
+		if (__atomic_load_n(&ports[i].reloading, __ATOMIC_ACQUIRE)) {
+			ReloadMessage("last configuration still being "
+				"changed to, try again");
+			return;
+		}
+		for (j=0;j<3;j++)
+			lines[i][j] = ports[i].line[j].config;
+	}
+
+	for (k=0;k<staged.nports;k++) {
+		port = &staged.port[k];
+		for (i=0;i<nports;i++)
+			if (!strcmp(ports[i].devname, port->devname))
+				break;
+		if (i==nports) {
+			ReloadMessage("%s is not in use, restart to use it",
+				port->devname);
+			continue;
+		}
+		p = &ports[i];
+		if ((port->poll!=p->poll) || (port->kernelpps!=p->kernelpps) ||
+				strcmp(port->recorddir, (p->recorddir!=NULL) ?
+				p->recorddir : ""))
+			ReloadMessage("poll, kernel-pps and record for %s "
+				"only change on restart", port->devname);
+		for (j=0;j<3;j++) {
+			lines[i][j] = port->line[j];
+			if (lines[i][j].unit<0)
+				lines[i][j].unit = (i*3)+j;
+		}
+	}
+
+	if ((k = CheckUnits(lines, nports))>=0) {
+		ReloadMessage("unit %d is used twice, keeping the old "
+			"configuration", k);
+		return;
+	}
+
+	/* the worker threads are woken to pick up the new settings */
+	for (i=0;i<nports;i++) {
+		memcpy(ports[i].reload, lines[i], sizeof(ports[i].reload));
+		__atomic_store_n(&ports[i].reloading, 1, __ATOMIC_RELEASE);
+		if (write(ports[i].queue.fd, &one, sizeof(one))<0)
+			ReloadMessage("unable to wake worker thread for %s",
+				ports[i].devname);
+	}
+
+	__atomic_store_n(&lockErrors, (staged.errors>=0) ? staged.errors :
+		lockErrors, __ATOMIC_RELAXED);
+	__atomic_store_n(&perSecond, (staged.seconds>=0) ? staged.seconds :
+		perSecond, __ATOMIC_RELAXED);
+	if (staged.latency[0]!='\0') {
+		strcpy(fileConfig.latency, staged.latency);
+		latencyFile = fileConfig.latency;
+	}
+	ReloadMessage("read configuration from %s", configFile);
+
+	return;
+}
+
+
+/*
+ * Add a signal to the set handled by the main loop, unless it was ignored
+ * when we were started
+ */
+void HandleSignal(sigset_t *mask, int sig)
+{
+	struct sigaction sa;
+
+	if ((sigaction(sig, NULL, &sa)==0) && (sa.sa_handler==SIG_IGN))
+		return;
+	sigaddset(mask, sig);
+
+	return;
+}
+
+
+/*
+ * Main event loop, handles signals and runs the watchdog once a second. All
+ * of the time critical work is done by the capture threads.
+ */
+void EventLoop(sigset_t *mask)
+{
+	int i,j,n,efd,sfd,tfd;
+	struct epoll_event ev,events[2];
+	struct signalfd_siginfo info;
+	struct itimerspec its;
+	uint64_t ticks,elapsed,synced;
+
+
+	if (((sfd = signalfd(-1, mask, SFD_CLOEXEC))<0) ||
+	    ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC))<0) ||
+	    ((efd = epoll_create1(EPOLL_CLOEXEC))<0)) {
+		if (test==0)
+			syslog(LOG_INFO, "unable to set up event loop: %m");
+		else
+			perror("radioclkd: unable to set up event loop");
+		Catch(0);
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = 1;
+	its.it_interval.tv_sec = 1;
+	timerfd_settime(tfd, 0, &its, NULL);
+	elapsed = 0;
+	synced = 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = sfd;
+	epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev);
+	ev.data.fd = tfd;
+	epoll_ctl(efd, EPOLL_CTL_ADD, tfd, &ev);
+
+	for (;;) {
+		n = epoll_wait(efd, events, 2, -1);
+		for (i=0;i<n;i++) {
+			if (events[i].data.fd==tfd) {
+				if (read(tfd, &ticks, sizeof(ticks))<=0)
+					continue;
+				SerialWatchdog();
+				elapsed += ticks;
+				synced += ticks;
+				if ((state!=NULL) && (synced>=STATE_PERIOD)) {
+					synced = 0;
+					msync(state, sizeof(struct stateFile),
+						MS_ASYNC);
+				}
+				if ((latencyFile!=NULL) &&
+						(elapsed>=LATENCY_PERIOD)) {
+					elapsed = 0;
+					if ((WriteLatencyFile()!=0) &&
+							(test==0))
+						syslog(LOG_INFO, "unable to "
+							"write %s: %m",
+							latencyFile);
+				}
+			} else if (read(sfd, &info, sizeof(info))==sizeof(info)) {
+				if (info.ssi_signo==SIGHUP) {
+					ReloadConfig();
+					continue;
+				}
+				if (info.ssi_signo==SIGUSR2) {
+					for (j=0;j<nports;j++)
+						LogCounters(&ports[j]);
+					if (probeCPU>=0)
+						LogLatency("probe", "wakeup",
+							&probeLatency);
+					continue;
+				}
+				Catch(info.ssi_signo);
+			}
+		}
+	}
+
+	return;
+}
+
+
+/*
+ * Replay a recording of edges as fast as possible, the recorded time stamps
+ * standing in for the system clock
+ */
+int ReplayEdges(char *file)
+{
+	FILE *str;
+	struct recordHeader header;
+	struct edgeRecord r[1024];
+	struct portInfo *p;
+	struct timespec ts;
+	size_t i,n;
+
+	if (!(str = fopen(file, "r"))) {
+		fprintf(stderr, "radioclkd: couldn't open recording %s\n", file);
+		return 1;
+	}
+
+	if ((fread(&header, sizeof(header), 1, str)!=1) ||
+			(memcmp(header.magic, RECORD_MAGIC, sizeof(header.magic))) ||
+			(header.version!=RECORD_VERSION) ||
+			(header.size!=sizeof(struct edgeRecord))) {
+		fprintf(stderr, "radioclkd: %s is not an edge recording\n",
+			file);
+		fclose(str);
+		return 1;
+	}
+
+	p = &ports[0];
+	p->name = "replay";
+	nports = 1;
+	InitPort(p, 0);
+
+	while ((n = fread(r, sizeof(struct edgeRecord), 1024, str))>0) {
+		for (i=0;i<n;i++) {
+			ts.tv_sec = r[i].sec;
+			ts.tv_nsec = r[i].nsec;
+			p->counters.edges++;
+			ProcessEdge(p, r[i].status, &ts);
+		}
+	}
+	fclose(str);
+
+	return 0;
+}
+
+
+/*
+ * Uniformly distributed random number in [0,1) for the signal generator,
+ * using xorshift64* so a given seed always gives the same signal
  */
-int TurnReceiverOn(int fd)
+double GenRandom(struct generator *g)
 {
-	int arg;
-
-	if (ioctl(fd, TIOCMGET, &arg)!=0)
-		return -1;
-	arg |= (TIOCM_DTR | TIOCM_RTS);
-	if (ioctl(fd, TIOCMSET, &arg)!=0)
-		return -1;
+	g->seed ^= g->seed>>12;
+	g->seed ^= g->seed<<25;
+	g->seed ^= g->seed>>27;
 
-	return 0;
+	return (double) ((g->seed*0x2545f4914f6cdd1dULL)>>11)/9007199254740992.0;
 }
 
 
 /*
- * Time out handler for the alarm on TIOCMIWAIT
+ * Normally distributed random number with a mean of 0 and a standard
+ * deviation of 1, by the Box-Muller method
  */
-void SerialTimeoutAlarm(int sig)
+double GenGaussian(struct generator *g)
 {
-//	signal(SIGALRM, SerialTimeoutAlarm);
-//	fprintf(stderr, "ALARM SIGNAL RECIEVED\n");
-	longjmp(saved, 1);
+	double u,v;
 
-	return;
+	do {
+		u = GenRandom(g);
+	} while (u<=0.0);
+	v = GenRandom(g);
+
+	return sqrt(-2.0*log(u))*cos(2.0*M_PI*v);
 }
 
 
 /*
- * Wait till either the DCD, CTS or DSR line changes status on the serial port
+ * Hand a generated edge to the decoder, or write it to the trace
  */
-int WaitOnSerialChange(int fd, struct timeval *tv)
+void EmitEdge(struct generator *g, int status, struct timespec *ts)
 {
-	int i,arg,cts,dcd,dsr;
-
-
-	/* loop polling for the DCD, CTS or DSR line to change status */
-	if (poll==1) {
-		if (ioctl(fd, TIOCMGET, &arg)!=0)
-			return -1;
-		dcd = arg & TIOCM_CD;
-		cts = arg & TIOCM_CTS;
-		dsr = arg & TIOCM_DSR;
-		for (i=0;i<2000;i++) {
-			usleep(5000);
-			if (ioctl(fd, TIOCMGET, &arg)!=0)
-				return -1;
-			gettimeofday(tv, NULL);
-			if ((dcd!=(arg & TIOCM_CD)) || (cts!=(arg & TIOCM_CTS))
-			    || (dsr!=(arg & TIOCM_DSR)))
-				return arg;
-		}
-		/* nothing changed for 10 seconds return with error */
-		return -1;
+	/* keep the edges in order whatever the jitter */
+	if ((ts->tv_sec<g->last.tv_sec) || ((ts->tv_sec==g->last.tv_sec) &&
+			(ts->tv_nsec<=g->last.tv_nsec))) {
+		*ts = g->last;
+		TimeSpecAdd(ts, 1000);
 	}
+	g->last = *ts;
 
-	/* set a timeout for TIOCMIWAIT */
-	if (setjmp(saved)!=0)
-		return -1;
-	signal(SIGALRM, SerialTimeoutAlarm);
-	alarm(10);
-
-	/* wait till a serial port status change interrupt is generated */
-	if (ioctl(fd, TIOCMIWAIT, TIOCM_CD | TIOCM_CTS | TIOCM_DSR)!=0)
-		return -1;
-	gettimeofday(tv, NULL);
-	if (ioctl(fd, TIOCMGET, &arg)!=0)
-		return -1;
-
-	/* cancel the timeout */
-	alarm(0);
+	if (g->trace!=NULL) {
+		WriteEdgeRecord(g->trace, status, ts);
+	} else {
+		if (bench!=NULL)
+			clock_gettime(CLOCK_MONOTONIC, &bench->edge);
+		g->port->counters.edges++;
+		ProcessEdge(g->port, status, ts);
+	}
 
-	return arg;
+	return;
 }
 
 
 /*
- * Place a time stamp in the SHM segment for the NTP reference clock driver
+ * Generate the edges of one second of the signal, a pulse being the
+ * carrier being reduced. start and length give the pulses in ms.
  */
-void PutTimeStamp(struct timeval *local, struct timeval *radio,
-	struct shmTime *shm, int leap)
+void GenerateSecond(struct generator *g, time_t t, int symbol)
 {
-	shm->mode = 1;
-	shm->valid = 0;
-
-	__asm__ __volatile__ ("":::"memory");
+	int start[3] = { 0, 200, 0 };
+	int length[3] = { 0, 100, 0 };
+	int i,n;
+	double glitch;
+	struct timespec ts;
+
+	/* a fade loses whole seconds of signal */
+	if (g->faded>0) {
+		g->faded--;
+		return;
+	}
+	if ((g->fade>0.0) && (GenRandom(g)<g->fade)) {
+		g->faded = g->fadelen-1;
+		return;
+	}
+	if ((g->drop>0.0) && (GenRandom(g)<g->drop))
+		return;
 
-	shm->leap = leap;
-	shm->precision = PRECISION;
-	shm->clockTimeStampSec = (time_t) radio->tv_sec;
-	shm->clockTimeStampUSec = (int) radio->tv_usec;
-	shm->receiveTimeStampSec = (time_t) local->tv_sec;
-	shm->receiveTimeStampUSec = (int) local->tv_usec;
+	switch (symbol) {
+		case SYMBOL_NONE:
+			n = 0;
+			break;
+		case SYMBOL_B:
+			length[0] = 100;
+			n = 2;
+			break;
+		default:
+			length[0] = symbol;
+			n = 1;
+			break;
+	}
 
-	__asm__ __volatile__ ("":::"memory");
+	/* a short spurious pulse somewhere after the real one(s) */
+	if ((g->glitch>0.0) && (GenRandom(g)<g->glitch)) {
+		glitch = GenRandom(g);
+		length[n] = 10+(int) (30*glitch);
+		start[n] = (n==0) ? 50 : start[n-1]+length[n-1]+50;
+		start[n] += (int) ((900-start[n]-length[n])*GenRandom(g));
+		if (start[n]+length[n]<950)
+			n++;
+	}
 
-	shm->count++;
-	shm->valid = 1;
+	for (i=0;i<n;i++) {
+		ts.tv_sec = t;
+		ts.tv_nsec = 0;
+		TimeSpecAdd(&ts, (start[i]*1000000L)+g->delay+
+			(long) (g->jitter*GenGaussian(g)));
+		EmitEdge(g, 0, &ts);
+
+		ts.tv_sec = t;
+		ts.tv_nsec = 0;
+		TimeSpecAdd(&ts, ((start[i]+length[i])*1000000L)+g->delay+
+			g->asymmetry+(long) (g->jitter*GenGaussian(g)));
+		EmitEdge(g, TIOCM_CD, &ts);
+	}
 
 	return;
 }
 
 
 /*
- * Time comparison routine for the C library quicksort routine
+ * Parse the description of the signal to generate, the protocol name
+ * followed by comma separated key=value pairs. Times are given in ms.
  */
-static int TimeCompare(const void *a, const void *b)
+int ParseGenerator(struct generator *g, char *spec)
 {
-	int timea,timeb;
-
-	timea = *(int *) a;
-	timeb = *(int *) b;
-
-	if (timea<timeb)
+	char *token,*value;
+	double x;
+
+	memset(g, 0, sizeof(struct generator));
+	g->start = time(NULL);
+	g->start -= g->start%60;
+	g->minutes = 60;
+	g->fadelen = 10;
+	g->seed = 1;
+
+	token = strtok(spec, ",");
+	if (token==NULL)
 		return -1;
-	else if (timea>timeb)
-		return +1;
+	if (!strcasecmp(token, "dcf77"))
+		g->radio = DCF77;
+	else if (!strcasecmp(token, "msf"))
+		g->radio = MSF;
+	else if (!strcasecmp(token, "wwvb"))
+		g->radio = WWVB;
 	else
-		return 0;
+		return -1;
+
+	while ((token = strtok(NULL, ","))!=NULL) {
+		if ((value = strchr(token, '='))==NULL)
+			return -1;
+		*value++ = '\0';
+		x = strtod(value, NULL);
+		if (!strcmp(token, "start"))
+			g->start = (time_t) x;
+		else if (!strcmp(token, "minutes"))
+			g->minutes = (int) x;
+		else if (!strcmp(token, "delay"))
+			g->delay = (long) (x*1000000.0);
+		else if (!strcmp(token, "jitter"))
+			g->jitter = (long) (x*1000000.0);
+		else if (!strcmp(token, "asymmetry"))
+			g->asymmetry = (long) (x*1000000.0);
+		else if (!strcmp(token, "glitch"))
+			g->glitch = x;
+		else if (!strcmp(token, "drop"))
+			g->drop = x;
+		else if (!strcmp(token, "fade"))
+			g->fade = x;
+		else if (!strcmp(token, "fadelen"))
+			g->fadelen = (int) x;
+		else if (!strcmp(token, "dut1"))
+			g->dut1 = (int) x;
+		else if (!strcmp(token, "seed"))
+			g->seed = (uint64_t) x;
+		else
+			return -1;
+	}
+	if ((g->minutes<1) || (g->fadelen<1) || (g->seed==0))
+		return -1;
+
+	return 0;
 }
 
 
 /*
- * Calculate the average measured offset of the start of the radioclock
- * pulses from the true time over the last minute
+ * Generate a synthetic time signal, either decoding it straight away or
+ * writing it out as an edge recording that can be replayed
  */
-int CalculatePPSAverage(struct clockInfo *c, int *average)
+int GenerateSignal(struct generator *g, char *file)
 {
-	int i,err,count;
-	long sum;
-	int timediff[59] = { 0 };
-
-	/* this only works if we have a full minutes worth of clock pulses */
-	if (c->count<59)
-		return -1;
-
-	/* calculate the measured clock offset for the start of each pulse */
-	for (i=0;i<59;i++) {
-		/* calculate time difference between computer and radio
-		   for each second marker */
-		err = (int) c->pulses[c->count-i-1].tv_usec;
-		if (err>500000)
-			err -= 1000000;
-			
-		/* if the time isn't close, don't bother tracking it */
-		if (abs(err)>128000)
-			return -1;
+	struct recordHeader header;
+	struct timespec ts;
+	int i,j,symbol[60];
+	time_t t;
+
+	if (file!=NULL) {
+		if (!(g->trace = fopen(file, "w"))) {
+			fprintf(stderr, "radioclkd: couldn't create %s\n", file);
+			return 1;
+		}
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+		header.version = RECORD_VERSION;
+		header.size = sizeof(struct edgeRecord);
+		fwrite(&header, sizeof(header), 1, g->trace);
+	} else {
+		g->port = &ports[0];
+		g->port->name = "generated";
+		nports = 1;
+		InitPort(g->port, 0);
+	}
 
-		timediff[i] = err;
+	/* start with the carrier on, half a second before the first minute */
+	ts.tv_sec = g->start-1;
+	ts.tv_nsec = 500000000;
+	EmitEdge(g, TIOCM_CD, &ts);
+
+	for (i=0,t=g->start;i<g->minutes;i++,t+=60) {
+		switch (g->radio) {
+			case DCF77:
+				EncodeDCF77(g, t, symbol);
+				break;
+			case MSF:
+				EncodeMSF(g, t, symbol);
+				break;
+			case WWVB:
+				EncodeWWVB(g, t, symbol);
+				break;
+		}
+		for (j=0;j<60;j++)
+			GenerateSecond(g, t+j, symbol[j]);
 	}
 
-	/* now sort them into order */
-	qsort(timediff, 59, sizeof(long), TimeCompare);
+	/* the minute marker that ends the last minute */
+	GenerateSecond(g, t, (g->radio==DCF77) ? SYMBOL_100 :
+		((g->radio==MSF) ? SYMBOL_500 : SYMBOL_800));
 
-	/* calculate the arithmetic mean of the middle half */
-	count = 0;
-	sum = 0;
-	for (i=15;i<45;i++) {
-		sum += timediff[i];
-		count++;
-	}
-	*average = (int) sum/count;
+	if (g->trace!=NULL)
+		fclose(g->trace);
 
 	return 0;
 }
 
 
 /*
- * Process a received time code and place stamp into shared memory
+ * Compare two longs for the C library quicksort routine
  */
-void ProcessTimeCode(struct clockInfo *c, int radio)
+static int LongCompare(const void *a, const void *b)
 {
-	time_t decoded,last;
-	struct timeval computer,received;
-	int i,shmid,average;
-
-
-	/* decode the time */
-	switch (radio) {
-		case DCF77:
-			decoded = DecodeDCF77(c->code, c->count);
-			break;
-		case MSF:
-			decoded = DecodeMSF(c->code, c->count);
-			break;
-		case WWVB:
-			decoded = DecodeWWVB(c->code, c->count);
-			break;
-		default:
-			c->count = 1;
-			c->marker = 0x00;
-			c->frame = 0;
-			c->correct = 0;
-			return;
-	}
-
-	/* place time stamp into shared memory segment or print on stdout */	
-	if (test==0) {
-		/* final sanity check on the time */
-		if (abs(c->start.tv_sec-decoded)>1000) {
-			syslog(LOG_INFO, "decoded time differs from system "
-				"time by more than 1000s ignored");
-			c->count = 1;
-			c->marker = 0x00;
-			c->frame = 0;
-			c->correct = 0;
-			return;
-		}
+	long x,y;
 
-		/* attach shared memory segment if not already done */
-		if (c->stamp==NULL) {
-			c->stamp = AttachSharedMemory(c->unit, &shmid);
-			if ((shmid==-1) || (c->stamp==NULL)) {
-				syslog(LOG_INFO, "unable to attach shared "
-					"memory for %s", c->line);
-					return;
-			}
-		}
+	x = *(long *) a;
+	y = *(long *) b;
 
-		/* if possible use an averaged offset */
-		if (CalculatePPSAverage(c, &average)<0) {
-			computer.tv_sec = c->start.tv_sec;
-			computer.tv_usec = c->start.tv_usec;
-		} else {
-			if (average<0) {
-				computer.tv_sec = decoded-1;
-				computer.tv_usec = average+1000000;
-			} else {
-				computer.tv_sec = decoded;
-				computer.tv_usec = average;
-			}
-		}
-		
-		/* put time stamp in shared memory segment for ntpd */
-		received.tv_sec = decoded;
-		received.tv_usec = 0;
-		PutTimeStamp(&computer, &received, c->stamp, LEAP_NOWARNING);
+	return (x<y) ? -1 : ((x>y) ? 1 : 0);
+}
 
-		/* log any errors in getting the time */
-		last = decoded-c->last;
-		if ((last>3600) && (c->error>0)) {
-			syslog(LOG_INFO, " %ldh %ldm since previous valid time "
-				"for %s line", last/3600, (last%3600)/60,
-				c->line);
-		} else if ((last>300) && (c->error>0)) {
-			syslog(LOG_INFO, " %ldm since previous valid time for %s"
-				" line", last/60, c->line);
-		}
-	} else {
-		/* any valid time is printed in testing mode */
-		for (i=1;i<c->count;i++)
-			fprintf(stdout, "%1d", c->code[i]);
-		fprintf(stdout, "\nUTC: %s", ctime(&decoded));
-	}
 
-	/* reset the error warning and set last stamp time */
-	c->error = 0;
-	c->last = decoded;
+/*
+ * Value at a percentile of a sorted array
+ */
+long Percentile(long *sorted, int n, double percent)
+{
+	int i;
 
-	/* setup for receiving the next minute of pulses */
-	c->count = 1;
-	c->marker = 0x00;
-	c->frame = 0;
-	c->correct = 0;
+	if (n==0)
+		return 0;
+	i = (int) ((percent/100.0)*(n-1)+0.5);
 
-	return;
+	return sorted[i];
 }
 
 
 /*
- * Process a status change on the serial port to calculate the pulse type.
- * If a minute marker is present send time stamp to ntpd.
+ * Benchmark the decoder against one synthetic signal, printing the results
+ * as a line of JSON
  */
-void ProcessStatusChange(struct clockInfo *c, int arg, struct timeval *tv)
+int BenchSignal(char *spec)
 {
-	struct timeval length;
+	static const char *names[] = { "", "msf", "dcf77", "", "wwvb" };
+	struct generator g;
+	struct benchInfo b;
+	struct timespec start,end;
+	char description[256];
+	double cpu,mean,sd;
+	int i;
+
+	snprintf(description, sizeof(description), "%s", spec);
+	if (ParseGenerator(&g, spec)!=0) {
+		fprintf(stderr, "radioclkd: invalid signal description %s\n",
+			description);
+		return 1;
+	}
 
-	if ((!arg) && (c->status==1)) {
-		c->status = 0;
-		c->start.tv_sec = tv->tv_sec;
-		c->start.tv_usec = tv->tv_usec;
-		timersub(&c->start, &c->end, &length);
-		/* check for the DCF77 minute marker */
-		if ((length.tv_sec==1) && (length.tv_usec>=760000) &&
-				(length.tv_usec<=950000) && (c->count>44)) {
-			
-			c->pulses[c->count].tv_sec = c->start.tv_sec;
-			c->pulses[c->count].tv_usec = c->start.tv_usec;
-			ProcessTimeCode(c, DCF77);
-			return;
-		}
+	memset(&b, 0, sizeof(b));
+	b.start = g.start;
+	b.minutes = g.minutes;
+	b.delay = g.delay;
+	b.latency = (long *) malloc(g.minutes*sizeof(long));
+	b.offset = (long *) malloc(g.minutes*sizeof(long));
+	if ((b.latency==NULL) || (b.offset==NULL)) {
+		fprintf(stderr, "radioclkd: out of memory\n");
+		return 1;
+	}
+	bench = &b;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+	GenerateSignal(&g, NULL);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+	bench = NULL;
+
+	TimeSpecSub(&end, &start, &end);
+	cpu = ((end.tv_sec*1e9)+end.tv_nsec)/1000.0/(g.minutes/60.0);
+
+	/* mean and standard deviation of the offset error */
+	for (i=0,mean=0.0;i<b.decoded;i++)
+		mean += b.offset[i];
+	mean = (b.decoded>0) ? mean/b.decoded : 0.0;
+	for (i=0,sd=0.0;i<b.decoded;i++)
+		sd += (b.offset[i]-mean)*(b.offset[i]-mean);
+	sd = (b.decoded>1) ? sqrt(sd/(b.decoded-1)) : 0.0;
+
+	/* the percentiles are of the size of the error */
+	for (i=0;i<b.decoded;i++)
+		b.offset[i] = labs(b.offset[i]);
+	qsort(b.latency, b.decoded, sizeof(long), LongCompare);
+	qsort(b.offset, b.decoded, sizeof(long), LongCompare);
+
+	fprintf(stdout, "{\"signal\":\"%s\",\"protocol\":\"%s\","
+		"\"minutes\":%d,\"decoded\":%d,\"wrong\":%d,"
+		"\"success\":%.4f,", description, names[g.radio], g.minutes,
+		b.decoded, b.wrong, (double) b.decoded/g.minutes);
+	fprintf(stdout, "\"latency_ns\":{\"p50\":%ld,\"p90\":%ld,"
+		"\"p99\":%ld,\"max\":%ld},",
+		Percentile(b.latency, b.decoded, 50),
+		Percentile(b.latency, b.decoded, 90),
+		Percentile(b.latency, b.decoded, 99),
+		Percentile(b.latency, b.decoded, 100));
+	fprintf(stdout, "\"offset_error_ns\":{\"mean\":%.0f,\"sd\":%.0f,"
+		"\"p50\":%ld,\"p95\":%ld,\"p99\":%ld,\"max\":%ld},",
+		mean, sd, Percentile(b.offset, b.decoded, 50),
+		Percentile(b.offset, b.decoded, 95),
+		Percentile(b.offset, b.decoded, 99),
+		Percentile(b.offset, b.decoded, 100));
+	fprintf(stdout, "\"cpu_us_per_hour\":%.1f}\n", cpu);
+
+	free(b.latency);
+	free(b.offset);
 
-		/* check to see if bit B of the MSF code set */
-		if ((length.tv_usec>=60000) && (length.tv_usec<=150000)) {
-			c->code[c->count-1] = 3;
-			c->correct = 1;
-		}
+	return 0;
+}
 
-	} else if ((arg) && (c->status==0)) {
-		c->status = 1;
-		c->end.tv_sec = tv->tv_sec;
-		c->end.tv_usec = tv->tv_usec;
-		timersub(&c->end, &c->start, &length);
 
-		if (c->correct==1) {
-			/* make a correction for MSF bit B being set */
-			c->correct = 0;
-			return;			
-		} else if ((length.tv_usec>=60000) && (length.tv_usec<150000)) {
-			c->code[c->count] = 0;
-			c->pulses[c->count].tv_sec = c->start.tv_sec;
-			c->pulses[c->count].tv_usec = c->start.tv_usec;
-			c->count++;
-			c->frame = 0;
-			c->marker = c->marker<<1;
-		} else if ((length.tv_usec>=160000) && (length.tv_usec<250000)) {
-			c->code[c->count] = 1;
-			c->pulses[c->count].tv_sec = c->start.tv_sec;
-			c->pulses[c->count].tv_usec = c->start.tv_usec;
-			c->count++;
-			c->frame = 0;
-			c->marker = (c->marker<<1) | 1;
-		} else if ((length.tv_usec>=260000) && (length.tv_usec<350000)) {
-			c->code[c->count] = 2;
-			c->pulses[c->count].tv_sec = c->start.tv_sec;
-			c->pulses[c->count].tv_usec = c->start.tv_usec;
-			c->count++;
-			c->frame = 0;
-			c->marker = (c->marker<<1) | 1;
-		} else if ((length.tv_usec>=460000) && (length.tv_usec<550000)) {
-			c->code[c->count] = 4;
-			c->pulses[c->count].tv_sec = c->start.tv_sec;
-			c->pulses[c->count].tv_usec = c->start.tv_usec;
-			c->count++;
-			c->frame = 0;
-			/* check for MSF minute marker */
-			if ((c->marker==0x7e) && (c->count>42)) {
-				ProcessTimeCode(c, MSF);
-				return;
-			}
-		} else if ((length.tv_usec>=760000) && (length.tv_usec<850000)) {
-			c->code[c->count] = 5;
-			c->pulses[c->count].tv_sec = c->start.tv_sec;
-			c->pulses[c->count].tv_usec = c->start.tv_usec;
-			c->count++;
-			c->frame++;
-			/* check for the WWVB minute marker */
-			if ((c->frame==2) && (c->count>60)) {
-				ProcessTimeCode(c, WWVB);
-				return;
-			}			
-		} else {
-			/* unknown pulse must be an error reset */
-			c->count = 1;
-			c->marker = 0x00;
-			c->frame = 0;
-			c->correct = 0;
+/*
+ * Run the benchmark suite, a day of each protocol under clean, jittery and
+ * badly impaired reception, or just the one signal given
+ */
+int BenchSuite(char *spec)
+{
+	static const char *radios[] = { "dcf77", "msf", "wwvb" };
+	static const char *conditions[] = {
+		"",
+		",jitter=2",
+		",jitter=5,asymmetry=15,glitch=0.02,drop=0.01,fade=0.0005"
+	};
+	char buffer[256];
+	int i,j;
+
+	if (spec!=NULL)
+		return BenchSignal(spec);
+
+	for (i=0;i<3;i++) {
+		for (j=0;j<3;j++) {
+			snprintf(buffer, sizeof(buffer), "%s,start=1711843200,"
+				"minutes=1440,delay=20%s", radios[i],
+				conditions[j]);
+			if (BenchSignal(buffer)!=0)
+				return 1;
 		}
-
-	}
-
-	/* check for missing minute marker and reset if needed */
-	if (c->count==128) {
-		c->count = 1;
-		c->marker = 0x00;
-		c->frame = 0;
-		c->correct = 0;
 	}
 
-	return;
+	return 0;
 }
 
 
 /*
- * Catch any signals sent, and exit cleanly.
+ * Check UTCtime against timegm() for every day from 1970 to 2199 at several
+ * times of day, the dates being counted out here rather than taken from the
+ * C library so that the two are independent
  */
-void Catch(int sig)
+int SelfTest(void)
 {
-	if (test==0) {
-		syslog(LOG_INFO, "Exiting...");
-		unlink(PID_FILE);
-		munlockall();
-		if (dcd.stamp!=NULL)
-			shmdt(dcd.stamp);
-		if (cts.stamp!=NULL)
-			shmdt(cts.stamp);
-		if (dsr.stamp!=NULL)
-			shmdt(dsr.stamp);
-	} else {
-		fprintf(stderr, "radioclkd: Exiting...\n" );
+	static const int monthDays[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30,
+		31, 30, 31 };
+	static const int times[4][3] = { { 0, 0, 0 }, { 6, 30, 15 },
+		{ 12, 0, 0 }, { 23, 59, 59 } };
+	struct tm tm;
+	int year,mon,mday,last,i;
+	long dates,wrong;
+	time_t t;
+
+
+	dates = wrong = 0;
+	for (year=1970;year<2200;year++) {
+		for (mon=0;mon<12;mon++) {
+			last = monthDays[mon];
+			if ((mon==1) && ((year%4==0) && ((year%100!=0) ||
+					(year%400==0))))
+				last++;
+			for (mday=1;mday<=last;mday++) {
+				for (i=0;i<4;i++) {
+					memset(&tm, 0, sizeof(tm));
+					tm.tm_year = year-1900;
+					tm.tm_mon = mon;
+					tm.tm_mday = mday;
+					tm.tm_hour = times[i][0];
+					tm.tm_min = times[i][1];
+					tm.tm_sec = times[i][2];
+					t = UTCtime(&tm);
+					if (t!=timegm(&tm)) {
+						if (wrong++==0)
+							fprintf(stderr, "radioclkd: "
+								"UTCtime wrong for "
+								"%04d-%02d-%02d "
+								"%02d:%02d:%02d\n",
+								year, mon+1, mday,
+								times[i][0],
+								times[i][1],
+								times[i][2]);
+					}
+					dates++;
+				}
+			}
+		}
 	}
-	close(serial);
 
-	exit(0);
+	printf("UTCtime checked against timegm() on %ld dates, %ld wrong\n",
+		dates, wrong);
+
+	return (wrong==0) ? 0 : 1;
 }
 
 
@@ -886,17 +6037,36 @@ void Catch(int sig)
  */
 int main(int argc, char *argv[]) 
 {
-	int i,pid,arg;
+	int i,j,pid,poll,kernelpps;
+	char *recorddir,*replayfile,*generate,*tracefile;
+	struct lineConfig line,lines[MAX_PORTS][3];
+	long delay[3];
+	char error[256];
+	struct generator g;
+	int benchmark,selftest;
 	struct sched_param schedp;
-	struct timeval tv;
-	time_t now;
+	struct sigaction sa;
+	pthread_attr_t attr;
+	pthread_t probe;
+	sigset_t mask;
 	FILE *str;
-	char devname[16] = "/dev/";
+	struct portInfo *p;
 
 
 	/* process the command line arguments */
 	poll = 0;
 	test = 0;
+	kernelpps = 0;
+	recorddir = NULL;
+	DefaultLineConfig(&line);
+	delay[0] = delay[1] = delay[2] = 0;
+	replayfile = NULL;
+	generate = NULL;
+	tracefile = NULL;
+	benchmark = 0;
+	selftest = 0;
+	replay = 0;
+	nports = 0;
 	for (i=1;i<argc;i++) {
 		if ((!strcmp(argv[i], "-h")) || (!strcmp(argv[i], "--help"))) {
 			fprintf(stdout, USAGE_STRING);
@@ -910,38 +6080,211 @@ int main(int argc, char *argv[])
 			test = 1;
 			/* switch timezone to UTC so time functions do right thing */
 			putenv("TZ=''");
+		} else if (((!strcmp(argv[i], "-a")) || (!strcmp(argv[i], "--average"))) && (i+1<argc)) {
+			averageWindow = atoi(argv[++i]);
+			if ((averageWindow<1) || (averageWindow>WINDOW_MAX)) {
+				fprintf(stderr, "radioclkd: error the averaging "
+					"window must be 1 to %d seconds\n",
+					WINDOW_MAX);
+				return 1;
+			}
+			line.average = averageWindow;
+		} else if (((!strcmp(argv[i], "-e")) || (!strcmp(argv[i], "--errors"))) && (i+1<argc)) {
+			lockErrors = atoi(argv[++i]);
+			if ((lockErrors<0) || (lockErrors>59)) {
+				fprintf(stderr, "radioclkd: error the number of "
+					"bit errors must be 0 to 59\n");
+				return 1;
+			}
+		} else if (((!strcmp(argv[i], "-s")) || (!strcmp(argv[i], "--seconds"))) && (i+1<argc)) {
+			i++;
+			if (!strcmp(argv[i], "raw")) {
+				perSecond = PER_SECOND_RAW;
+			} else if (!strcmp(argv[i], "mean")) {
+				perSecond = PER_SECOND_MEAN;
+			} else {
+				fprintf(stderr, "radioclkd: error unknown per "
+					"second mode %s\n", argv[i]);
+				return 1;
+			}
+		} else if (((!strcmp(argv[i], "-c")) || (!strcmp(argv[i], "--chrony"))) && (i+1<argc)) {
+			if (strlen(argv[++i])>=SOCKET_PATH) {
+				fprintf(stderr, "radioclkd: error the chrony "
+					"socket path is too long\n");
+				return 1;
+			}
+			strcpy(line.chrony, argv[i]);
+		} else if (((!strcmp(argv[i], "-L")) || (!strcmp(argv[i], "--latency"))) && (i+1<argc)) {
+			/* the file is written after changing directory to / */
+			if ((latencyFile = AbsolutePath(argv[++i]))==NULL) {
+				fprintf(stderr, "radioclkd: error no directory "
+					"for latency file %s\n", argv[i]);
+				return 1;
+			}
+			if (strlen(latencyFile)+5>=256) {
+				fprintf(stderr, "radioclkd: error the latency "
+					"file path is too long\n");
+				return 1;
+			}
+		} else if (((!strcmp(argv[i], "-P")) || (!strcmp(argv[i], "--probe"))) && (i+1<argc)) {
+			probeCPU = atoi(argv[++i]);
+			if ((probeCPU<0) || (probeCPU>=CPU_SETSIZE)) {
+				fprintf(stderr, "radioclkd: error no such cpu "
+					"%s\n", argv[i]);
+				return 1;
+			}
+		} else if ((!strcmp(argv[i], "-k")) || (!strcmp(argv[i], "--kernel-pps"))) {
+			kernelpps = 1;
+		} else if (((!strcmp(argv[i], "-r")) || (!strcmp(argv[i], "--record"))) && (i+1<argc)) {
+			recorddir = argv[++i];
+		} else if (((!strcmp(argv[i], "-l")) || (!strcmp(argv[i], "--location"))) && (i+1<argc)) {
+			if (ParseLocation(argv[++i], &line.latitude,
+					&line.longitude)!=0) {
+				fprintf(stderr, "radioclkd: error invalid "
+					"location %s\n", argv[i]);
+				return 1;
+			}
+			line.located = 1;
+		} else if (((!strcmp(argv[i], "-d")) || (!strcmp(argv[i], "--delay"))) && (i+1<argc)) {
+			if (ParseDelays(argv[++i], delay)!=0) {
+				fprintf(stderr, "radioclkd: error invalid "
+					"receiver delay %s\n", argv[i]);
+				return 1;
+			}
+		} else if (((!strcmp(argv[i], "-f")) || (!strcmp(argv[i], "--config"))) && (i+1<argc)) {
+			/* the file is read again on SIGHUP, after we have
+			   changed directory */
+			if ((configFile = realpath(argv[++i], NULL))==NULL) {
+				fprintf(stderr, "radioclkd: couldn't open "
+					"configuration file %s\n", argv[i]);
+				return 1;
+			}
+			if (LoadConfig(configFile, &fileConfig, error,
+					sizeof(error))!=0) {
+				fprintf(stderr, "radioclkd: %s\n", error);
+				return 1;
+			}
+			if (AddConfigPorts(&fileConfig)!=0)
+				return 1;
+		} else if (((!strcmp(argv[i], "-S")) || (!strcmp(argv[i], "--state"))) && (i+1<argc)) {
+			stateFile = argv[++i];
+		} else if (((!strcmp(argv[i], "-R")) || (!strcmp(argv[i], "--replay"))) && (i+1<argc)) {
+			replayfile = argv[++i];
+		} else if (((!strcmp(argv[i], "-G")) || (!strcmp(argv[i], "--generate"))) && (i+1<argc)) {
+			generate = argv[++i];
+		} else if (((!strcmp(argv[i], "-w")) || (!strcmp(argv[i], "--write"))) && (i+1<argc)) {
+			tracefile = argv[++i];
+		} else if ((!strcmp(argv[i], "-B")) || (!strcmp(argv[i], "--bench"))) {
+			benchmark = 1;
+		} else if ((!strcmp(argv[i], "-T")) || (!strcmp(argv[i], "--selftest"))) {
+			selftest = 1;
+		} else if (nports==MAX_PORTS) {
+			fprintf(stderr, "radioclkd: error at most %d serial "
+				"ports can be used\n", MAX_PORTS);
+			return 1;
 		} else {
-			strncat(devname, argv[i], 10);
+			p = &ports[nports++];
+			if (argv[i][0]=='/')
+				snprintf(p->devname, sizeof(p->devname), "%s",
+					argv[i]);
+			else
+				snprintf(p->devname, sizeof(p->devname),
+					"/dev/%s", argv[i]);
+			p->name = strrchr(p->devname, '/')+1;
+			p->poll = poll;
+			p->kernelpps = kernelpps;
+			p->recorddir = recorddir;
+			for (j=0;j<3;j++) {
+				p->config[j] = line;
+				p->config[j].delay = delay[j];
+			}
+		}
+	}
+
+	/* check the date arithmetic and go no further */
+	if (selftest==1)
+		return SelfTest();
+
+	/* replay a recording or a synthetic signal instead of using a serial
+	   port, syslog messages are not wanted for this */
+	if ((replayfile!=NULL) || (generate!=NULL) || (benchmark==1)) {
+		if ((nports>0) || ((replayfile!=NULL) && (generate!=NULL))) {
+			fprintf(stderr, "radioclkd: error only one of a serial "
+				"port, recording or synthetic signal can be "
+				"used\n");
+			return 1;
+		}
+		replay = 1;
+		setlogmask(LOG_UPTO(LOG_ERR));
+		for (j=0;j<3;j++) {
+			ports[0].config[j] = line;
+			ports[0].config[j].delay = delay[j];
+		}
+		if (benchmark==1) {
+			test = 0;
+			return BenchSuite(generate);
+		}
+		if (generate!=NULL) {
+			if (ParseGenerator(&g, generate)!=0) {
+				fprintf(stderr, "radioclkd: invalid signal "
+					"description\n");
+				return 1;
+			}
+			return GenerateSignal(&g, tracefile);
 		}
+		return ReplayEdges(replayfile);
 	}
 			
-	if (strlen(devname)<6) {
+	if (nports==0) {
 		fprintf(stderr, "radioclkd: error no serial port specified\n");
 		return 1;
 	}
 
-	/* open the serial port */
-	if ((serial = open(devname, O_RDWR | O_NOCTTY | O_NDELAY))<0) {
-		fprintf(stderr, "radioclkd: couldn't open device %s\n", devname);
+	/* every line must send its time stamps to a unit of its own */
+	for (i=0;i<nports;i++)
+		memcpy(lines[i], ports[i].config, sizeof(lines[i]));
+	if ((j = CheckUnits(lines, nports))>=0) {
+		fprintf(stderr, "radioclkd: error unit %d is used twice\n", j);
 		return 1;
 	}
 
-	/* register some signal handlers */
-	if (signal(SIGINT, SIG_IGN)!=SIG_IGN)
-		signal(SIGINT, Catch);
-	if (signal(SIGQUIT, SIG_IGN )!=SIG_IGN)
-		signal(SIGQUIT, Catch);
-	if (signal(SIGTERM, SIG_IGN)!=SIG_IGN)
-		signal(SIGTERM, Catch);
-	signal(SIGUSR1, SIG_IGN);
+	/* open the serial ports and power up the receiver(s) */
+	for (i=0;i<nports;i++) {
+		if (OpenPort(&ports[i])!=0) {
+			while (i-->0)
+				close(ports[i].fd);
+			return 1;
+		}
+	}
 
-	/* power up the receiver(s) */
-	if (TurnReceiverOn(serial)!=0) {
-		fprintf(stderr, "radioclkd: error powering up receiver\n");
-		close(serial);
-		return 1;
+	/* open the recordings of the edges */
+	for (i=0;i<nports;i++) {
+		if ((ports[i].recorddir!=NULL) &&
+				(OpenRecording(&ports[i], ports[i].recorddir)!=0)) {
+			for (i=0;i<nports;i++)
+				close(ports[i].fd);
+			return 1;
+		}
 	}
 
+	/* the signals we handle are blocked and read from a signalfd by the
+	   main loop, the capture threads inherit this mask */
+	sigemptyset(&mask);
+	HandleSignal(&mask, SIGINT);
+	HandleSignal(&mask, SIGQUIT);
+	HandleSignal(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	signal(SIGUSR1, SIG_IGN);
+
+	/* the watchdog uses SIGALRM to wake a capture thread from TIOCMIWAIT,
+	   the handler is installed once and without SA_RESTART */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SerialTimeoutAlarm;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGALRM, &sa, NULL);
+
 	/* check to see if a copy of radioclkd is already running */
 	if (!access(PID_FILE, R_OK)) {
 		if ((str = fopen(PID_FILE, "r" ))) {
@@ -974,7 +6317,8 @@ int main(int argc, char *argv[])
  				fprintf(str, "%d\n", pid);
  				fclose(str);
  			}
- 			close(serial);
+			for (i=0;i<nports;i++)
+				close(ports[i].fd);
  			return 0;
  		}
  
@@ -982,7 +6326,8 @@ int main(int argc, char *argv[])
  		if (pid!=0) {
  			syslog(LOG_INFO, "fork() failed: %m");
  			unlink(PID_FILE);
- 			close(serial);
+			for (i=0;i<nports;i++)
+				close(ports[i].fd);
  			return 1;
  		} else {
  			syslog(LOG_INFO, "entering daemon mode");
@@ -994,11 +6339,13 @@ int main(int argc, char *argv[])
  		if (setsid()<0) {
  			syslog(LOG_INFO, "setsid() failed: %m");
  			unlink(PID_FILE);
- 			close(serial);
+			for (i=0;i<nports;i++)
+				close(ports[i].fd);
  			return 1;
  		}
 
-		/* set realtime scheduling priority */
+		/* set realtime scheduling priority, inherited by the capture
+		   threads */
 		memset(&schedp, 0, sizeof(schedp));
 		schedp.sched_priority = sched_get_priority_max(SCHED_FIFO);	
 		if (sched_setscheduler(0, SCHED_FIFO, &schedp)!=0)
@@ -1011,53 +6358,113 @@ int main(int argc, char *argv[])
 	
 	}
 
-	/* pause a few seconds to allow receiver(s) to power up */
-	sleep(5);
+	/* carry on from the tracking state saved by the last run */
+	if ((stateFile!=NULL) && (MapState(stateFile)!=0)) {
+		if (test==0)
+			syslog(LOG_INFO, "unable to use state file %s: %m",
+				stateFile);
+		else
+			fprintf(stderr, "radioclkd: unable to use state file "
+				"%s\n", stateFile);
+	}
+
+	/* wait for the receiver(s) to power up */
+	WaitForReceivers();
 
 	/* some safety precautions */
 	chdir("/");
 	umask(0);
 
-	/* initialize the three clock structures */
-	memset(&dcd, 0, sizeof(struct clockInfo));
-	memset(&cts, 0, sizeof(struct clockInfo));
-	memset(&dsr, 0, sizeof(struct clockInfo));
-	dcd.count = cts.count = dsr.count = 1;
-	dcd.last = cts.last = dsr.last = -1;
-	dcd.unit = 0;
-	cts.unit = 1;
-	dsr.unit = 2;
-	strcpy(dcd.line, "DCD");
-	strcpy(cts.line, "CTS");
-	strcpy(dsr.line, "DSR");
-
-	/* loop  until we die */
-	for (;;) {
-		arg = WaitOnSerialChange(serial, &tv);
-
-		/* first process any clock on the DCD status line */
-		ProcessStatusChange(&dcd, (arg & TIOCM_CD), &tv);
-
-		/* now do the same for a clock on the CTS line */
-		ProcessStatusChange(&cts, (arg & TIOCM_CTS), &tv);
+	/* initialize the clock structures for each port */
+	for (i=0;i<nports;i++)
+		InitPort(&ports[i], i);
+
+	if (state!=NULL)
+		for (i=0;i<nports;i++)
+			for (j=0;j<3;j++)
+				RestoreState(&ports[i].line[j], (i*3)+j);
+
+	/* publish the statistics of every line for radioclkstat */
+	if (AttachStatistics()!=0) {
+		if (test==0)
+			syslog(LOG_INFO, "unable to create statistics segment");
+		else
+			fprintf(stderr, "radioclkd: unable to create "
+				"statistics segment\n");
+	}
 
-		/* now do the same for a clock on the DSR line */
-		ProcessStatusChange(&dsr, (arg & TIOCM_DSR), &tv);
+	/* start a worker thread per serial port at normal priority, then a
+	   capture thread per serial port, all with a small stack as all pages
+	   are locked into memory */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, STACK_SIZE);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	memset(&schedp, 0, sizeof(schedp));
+	pthread_attr_setschedparam(&attr, &schedp);
+	for (i=0;i<nports;i++) {
+		if (((ports[i].queue.fd = eventfd(0, EFD_CLOEXEC))<0) ||
+				(pthread_create(&ports[i].worker, &attr,
+				ProcessPort, &ports[i])!=0)) {
+			if (test==0)
+				syslog(LOG_INFO, "unable to start worker "
+					"thread for %s", ports[i].devname);
+			else
+				fprintf(stderr, "radioclkd: unable to start "
+					"worker thread for %s\n",
+					ports[i].devname);
+			Catch(0);
+		}
+	}
+	pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+	for (i=0;i<nports;i++) {
+		if (pthread_create(&ports[i].thread, &attr, CapturePort,
+				&ports[i])!=0) {
+			if (test==0)
+				syslog(LOG_INFO, "unable to start capture "
+					"thread for %s", ports[i].devname);
+			else
+				fprintf(stderr, "radioclkd: unable to start "
+					"capture thread for %s\n",
+					ports[i].devname);
+			Catch(0);
+		}
+	}
 
-		/* print pulse information on stdout if in test mode */
-		if ((test==1) && ((dcd.status==1) || (cts.status==1) || (dsr.status==1))) {
-			PrintPulseInfo(&dcd);
-			PrintPulseInfo(&cts);
-			PrintPulseInfo(&dsr);
-			fprintf(stdout, "\n");
+	/* the latency probe runs just below the capture threads, so it sees
+	   what they would without getting in their way */
+	if (probeCPU>=0) {
+		if (test==0) {
+			pthread_attr_setinheritsched(&attr,
+				PTHREAD_EXPLICIT_SCHED);
+			pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+			schedp.sched_priority =
+				sched_get_priority_max(SCHED_FIFO)-1;
+			pthread_attr_setschedparam(&attr, &schedp);
+		}
+		if (pthread_create(&probe, &attr, ProbeLatency, NULL)!=0) {
+			if (test==0)
+				syslog(LOG_INFO, "unable to start latency "
+					"probe");
+			else
+				fprintf(stderr, "radioclkd: unable to start "
+					"latency probe\n");
 		}
+	}
+	pthread_attr_destroy(&attr);
 
-		/* warn if valid time stamp not received in the last 5 mins */
-		time(&now);
-		LogNoSignalWarning(&dcd, now);
-		LogNoSignalWarning(&cts, now);
-		LogNoSignalWarning(&dsr, now);
+	/* the capture threads have inherited real time scheduling, the event
+	   loop logs and writes files so it goes back to normal priority */
+	if (test==0) {
+		memset(&schedp, 0, sizeof(schedp));
+		if (pthread_setschedparam(pthread_self(), SCHED_OTHER,
+				&schedp)!=0)
+			syslog(LOG_INFO, "error unable to set normal "
+				"scheduling for the main thread");
 	}
 
+	/* the threads never return, run the event loop till we die */
+	EventLoop(&mask);
+
 	return 0;
 }
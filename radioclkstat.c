@@ -0,0 +1,345 @@
+/* radioclkstat.c -- print the statistics radioclkd keeps for each line, as
+ *                   text or in the Prometheus text exposition format
+ *
+ * Copyright (c) 2001-03  Jonathan A. Buzzard (jonathan@buzzard.org.uk)
+ *
+ * The statistics are read straight out of the shared memory segment that
+ * radioclkd writes them to, so reading them never wakes up or holds up the
+ * daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdint.h>
+#include<string.h>
+#include<time.h>
+#include<sched.h>
+#include<sys/types.h>
+#include<sys/ipc.h>
+#include<sys/shm.h>
+#include "radioclkstat.h"
+
+
+#define USAGE_STRING "\
+Usage: radioclkstat [-p]\n\
+Print the statistics of the lines decoded by radioclkd\n\n\
+  -p,--prometheus  print in the Prometheus text exposition format\n\
+  -h,--help     display this help message\n\
+Report bugs to jonathan@buzzard.org.uk\n"
+
+/* times to try for a consistent copy of a line before giving up */
+#define READ_TRIES 1000
+
+static const char *symbolName[STATS_SYMBOLS] = { "100ms", "200ms", "300ms",
+	"bitb", "500ms", "800ms", "unknown" };
+static const char *protocolName[STATS_PROTOCOLS] = { "dcf77", "msf", "wwvb" };
+
+
+/*
+ * Copy the statistics of a line out of the segment, retrying while the
+ * daemon is part way through updating them. Returns -1 if no consistent
+ * copy could be had.
+ */
+int ReadLine(struct lineStats *from, struct lineStats *to)
+{
+	uint32_t seq;
+	int i;
+
+	for (i=0;i<READ_TRIES;i++) {
+		seq = __atomic_load_n(&from->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1)==0) {
+			memcpy(to, from, sizeof(struct lineStats));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&from->seq, __ATOMIC_RELAXED)==seq)
+				return 0;
+		}
+		sched_yield();
+	}
+
+	return -1;
+}
+
+
+/*
+ * Print the statistics of a line as text
+ */
+void PrintText(struct lineStats *st, time_t now)
+{
+	int i;
+
+	printf("%s (unit %d)\n", st->name, st->unit);
+	printf("  pulses:");
+	for (i=0;i<STATS_SYMBOLS;i++)
+		printf(" %s %llu", symbolName[i],
+			(unsigned long long) st->pulses[i]);
+	printf("\n  erased seconds: %llu, frames restarted: %llu\n",
+		(unsigned long long) st->erasures,
+		(unsigned long long) st->resets);
+	for (i=0;i<STATS_PROTOCOLS;i++) {
+		if (st->attempts[i]==0)
+			continue;
+		printf("  %s: %llu minute markers, %llu decoded, %llu soft "
+			"decoded, %llu predicted\n", protocolName[i],
+			(unsigned long long) st->attempts[i],
+			(unsigned long long) st->decoded[i],
+			(unsigned long long) st->soft[i],
+			(unsigned long long) st->locked[i]);
+	}
+	printf("  failures: %llu format %llu parity %llu sanity, %llu locks "
+		"lost\n", (unsigned long long) st->format,
+		(unsigned long long) st->parity,
+		(unsigned long long) st->sanity,
+		(unsigned long long) st->unlocks);
+	printf("  time stamps published: %llu, ", (unsigned long long)
+		st->published);
+	if (st->lastFix>0)
+		printf("last fix %llds ago\n", (long long) (now-st->lastFix));
+	else
+		printf("no fix yet\n");
+	printf("  last offset %.6fms, filter phase %.6fms frequency "
+		"%.3fppm after %d updates, precision %d\n",
+		st->offset/1e6, st->phase/1e6, st->freq/1e3, st->filtered,
+		st->precision);
+	printf("  pulse widths learned:");
+	for (i=0;i<STATS_WIDTHS;i++)
+		printf(" %s %.1f+-%.1fms", symbolName[i], st->width[i],
+			st->deviation[i]);
+	printf("\n");
+
+	return;
+}
+
+
+/*
+ * Print the type and help lines of a metric, before its first sample
+ */
+void PrintMetric(const char *name, const char *type, const char *help)
+{
+	printf("# HELP radioclkd_%s %s\n", name, help);
+	printf("# TYPE radioclkd_%s %s\n", name, type);
+
+	return;
+}
+
+
+/*
+ * Print the statistics of every line in the Prometheus text exposition
+ * format, grouped by metric as the format requires
+ */
+void PrintPrometheus(struct lineStats *st, int n, time_t now)
+{
+	int i,j;
+
+#define LABELS "line=\"%s\",unit=\"%d\""
+
+	PrintMetric("pulses_total", "counter", "Second markers by pulse type");
+	for (i=0;i<n;i++)
+		for (j=0;j<STATS_SYMBOLS;j++)
+			printf("radioclkd_pulses_total{" LABELS ",type=\"%s\"} "
+				"%llu\n", st[i].name, st[i].unit, symbolName[j],
+				(unsigned long long) st[i].pulses[j]);
+
+	PrintMetric("erased_seconds_total", "counter",
+		"Seconds erased from the frame");
+	for (i=0;i<n;i++)
+		printf("radioclkd_erased_seconds_total{" LABELS "} %llu\n",
+			st[i].name, st[i].unit,
+			(unsigned long long) st[i].erasures);
+
+	PrintMetric("frame_resets_total", "counter",
+		"Frames started over after a gap");
+	for (i=0;i<n;i++)
+		printf("radioclkd_frame_resets_total{" LABELS "} %llu\n",
+			st[i].name, st[i].unit,
+			(unsigned long long) st[i].resets);
+
+	PrintMetric("frames_attempted_total", "counter",
+		"Minute markers seen by protocol");
+	for (i=0;i<n;i++)
+		for (j=0;j<STATS_PROTOCOLS;j++)
+			printf("radioclkd_frames_attempted_total{" LABELS
+				",protocol=\"%s\"} %llu\n", st[i].name,
+				st[i].unit, protocolName[j],
+				(unsigned long long) st[i].attempts[j]);
+
+	PrintMetric("frames_decoded_total", "counter",
+		"Minutes decoded by protocol and method");
+	for (i=0;i<n;i++) {
+		for (j=0;j<STATS_PROTOCOLS;j++) {
+			printf("radioclkd_frames_decoded_total{" LABELS
+				",protocol=\"%s\",method=\"hard\"} %llu\n",
+				st[i].name, st[i].unit, protocolName[j],
+				(unsigned long long) st[i].decoded[j]);
+			printf("radioclkd_frames_decoded_total{" LABELS
+				",protocol=\"%s\",method=\"soft\"} %llu\n",
+				st[i].name, st[i].unit, protocolName[j],
+				(unsigned long long) st[i].soft[j]);
+			printf("radioclkd_frames_decoded_total{" LABELS
+				",protocol=\"%s\",method=\"predicted\"} %llu\n",
+				st[i].name, st[i].unit, protocolName[j],
+				(unsigned long long) st[i].locked[j]);
+		}
+	}
+
+	PrintMetric("decode_failures_total", "counter",
+		"Minutes that failed to decode directly by reason");
+	for (i=0;i<n;i++) {
+		printf("radioclkd_decode_failures_total{" LABELS
+			",reason=\"format\"} %llu\n", st[i].name, st[i].unit,
+			(unsigned long long) st[i].format);
+		printf("radioclkd_decode_failures_total{" LABELS
+			",reason=\"parity\"} %llu\n", st[i].name, st[i].unit,
+			(unsigned long long) st[i].parity);
+		printf("radioclkd_decode_failures_total{" LABELS
+			",reason=\"sanity\"} %llu\n", st[i].name, st[i].unit,
+			(unsigned long long) st[i].sanity);
+	}
+
+	PrintMetric("locks_lost_total", "counter",
+		"Times the lock on the expected time code was lost");
+	for (i=0;i<n;i++)
+		printf("radioclkd_locks_lost_total{" LABELS "} %llu\n",
+			st[i].name, st[i].unit,
+			(unsigned long long) st[i].unlocks);
+
+	PrintMetric("published_total", "counter", "Time stamps published");
+	for (i=0;i<n;i++)
+		printf("radioclkd_published_total{" LABELS "} %llu\n",
+			st[i].name, st[i].unit,
+			(unsigned long long) st[i].published);
+
+	PrintMetric("seconds_since_fix", "gauge",
+		"Seconds since the last minute was published");
+	for (i=0;i<n;i++)
+		if (st[i].lastFix>0)
+			printf("radioclkd_seconds_since_fix{" LABELS "} %lld\n",
+				st[i].name, st[i].unit,
+				(long long) (now-st[i].lastFix));
+
+	PrintMetric("offset_seconds", "gauge",
+		"Offset of the last second marker from the system clock");
+	for (i=0;i<n;i++)
+		printf("radioclkd_offset_seconds{" LABELS "} %.9f\n",
+			st[i].name, st[i].unit, st[i].offset/1e9);
+
+	PrintMetric("filter_phase_seconds", "gauge",
+		"Phase of the second markers estimated by the tracking filter");
+	for (i=0;i<n;i++)
+		printf("radioclkd_filter_phase_seconds{" LABELS "} %.9f\n",
+			st[i].name, st[i].unit, st[i].phase/1e9);
+
+	PrintMetric("filter_frequency_ppm", "gauge",
+		"Frequency of the system clock estimated by the tracking filter");
+	for (i=0;i<n;i++)
+		printf("radioclkd_filter_frequency_ppm{" LABELS "} %.6f\n",
+			st[i].name, st[i].unit, st[i].freq/1e3);
+
+	PrintMetric("pulse_width_seconds", "gauge",
+		"Centre of each class of pulse width learned");
+	for (i=0;i<n;i++)
+		for (j=0;j<STATS_WIDTHS;j++)
+			printf("radioclkd_pulse_width_seconds{" LABELS
+				",type=\"%s\"} %.6f\n", st[i].name, st[i].unit,
+				symbolName[j], st[i].width[j]/1e3);
+
+	PrintMetric("pulse_width_deviation_seconds", "gauge",
+		"Standard deviation of each class of pulse width learned");
+	for (i=0;i<n;i++)
+		for (j=0;j<STATS_WIDTHS;j++)
+			printf("radioclkd_pulse_width_deviation_seconds{" LABELS
+				",type=\"%s\"} %.6f\n", st[i].name, st[i].unit,
+				symbolName[j], st[i].deviation[j]/1e3);
+
+	PrintMetric("precision", "gauge",
+		"Precision of the last time stamp as a power of two seconds");
+	for (i=0;i<n;i++)
+		printf("radioclkd_precision{" LABELS "} %d\n", st[i].name,
+			st[i].unit, st[i].precision);
+
+#undef LABELS
+
+	return;
+}
+
+
+/*
+ * Entry point.
+ */
+int main(int argc, char *argv[])
+{
+	struct statsSegment *seg;
+	struct lineStats st[STATS_LINES];
+	int i,n,shmid,prometheus;
+	time_t now;
+
+
+	prometheus = 0;
+	for (i=1;i<argc;i++) {
+		if ((!strcmp(argv[i], "-p")) ||
+				(!strcmp(argv[i], "--prometheus"))) {
+			prometheus = 1;
+		} else if ((!strcmp(argv[i], "-h")) ||
+				(!strcmp(argv[i], "--help"))) {
+			fprintf(stdout, USAGE_STRING);
+			return 0;
+		} else {
+			fprintf(stderr, USAGE_STRING);
+			return 1;
+		}
+	}
+
+	/* attach the segment read only */
+	shmid = shmget(STATS_KEY, sizeof(struct statsSegment), 0);
+	if (shmid==-1) {
+		fprintf(stderr, "radioclkstat: radioclkd is not running\n");
+		return 1;
+	}
+	seg = (struct statsSegment *) shmat(shmid, 0, SHM_RDONLY);
+	if ((seg==(void *) -1) || (seg==0)) {
+		perror("radioclkstat: unable to attach statistics");
+		return 1;
+	}
+	if ((__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE)!=STATS_MAGIC) ||
+			(seg->version!=STATS_VERSION) ||
+			(seg->size!=sizeof(struct statsSegment))) {
+		fprintf(stderr, "radioclkstat: statistics are from a different "
+			"version of radioclkd\n");
+		return 1;
+	}
+
+	/* take a consistent copy of every line */
+	n = (seg->lines<STATS_LINES) ? seg->lines : STATS_LINES;
+	for (i=0;i<n;i++) {
+		if (ReadLine(&seg->line[i], &st[i])!=0) {
+			fprintf(stderr, "radioclkstat: unable to read the "
+				"statistics of line %d\n", i);
+			return 1;
+		}
+	}
+	shmdt(seg);
+	now = time(NULL);
+
+	if (prometheus==1) {
+		PrintPrometheus(st, n, now);
+	} else {
+		for (i=0;i<n;i++)
+			PrintText(&st[i], now);
+	}
+
+	return 0;
+}
@@ -0,0 +1,103 @@
+/* radioclkstat.h -- layout of the statistics segment written by radioclkd
+ *                   and read by radioclkstat
+ *
+ * Copyright (c) 2001-03  Jonathan A. Buzzard (jonathan@buzzard.org.uk)
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef RADIOCLKSTAT_H
+#define RADIOCLKSTAT_H
+
+#include<stdint.h>
+
+/*
+ * SysV shared memory segment holding the statistics of every line, written
+ * by the worker threads of radioclkd and readable by anyone
+ */
+#define STATS_KEY 0x52434c53
+#define STATS_MAGIC 0x52435354
+#define STATS_VERSION 2
+#define STATS_LINES 24
+
+/* pulse types counted, in the order of the symbols of the decoder with the
+   pulses of unknown length last */
+#define STATS_SYMBOLS 7
+#define STATS_UNKNOWN 6
+
+/* classes of pulse width learned, the pulse types bar the unknown */
+#define STATS_WIDTHS 6
+
+/* protocols counted */
+enum { STATS_DCF77, STATS_MSF, STATS_WWVB, STATS_PROTOCOLS };
+
+/*
+ * The statistics of a line. The sequence is odd while the worker thread is
+ * updating them, so a reader copies them out and takes the copy only if the
+ * sequence was the same even number before and after.
+ */
+struct lineStats {
+	uint32_t seq;
+	int32_t unit;
+	char name[32];
+
+	/* second markers by pulse type, and seconds erased from the frame */
+	uint64_t pulses[STATS_SYMBOLS];
+	uint64_t erasures;
+
+	/* minute markers seen, and minutes decoded from them directly, by the
+	   soft decoder, and predicted by the lock, by protocol */
+	uint64_t attempts[STATS_PROTOCOLS];
+	uint64_t decoded[STATS_PROTOCOLS];
+	uint64_t soft[STATS_PROTOCOLS];
+	uint64_t locked[STATS_PROTOCOLS];
+
+	/* why minutes failed to decode directly */
+	uint64_t format;
+	uint64_t parity;
+	uint64_t sanity;
+
+	/* frames started over after a long gap, and locks lost */
+	uint64_t resets;
+	uint64_t unlocks;
+
+	/* time stamps published, and the time of the last minute published */
+	uint64_t published;
+	int64_t lastFix;
+
+	/* offset of the last second marker, and the estimate of the tracking
+	   filter in ns and ns/s */
+	int64_t offset;
+	double phase;
+	double freq;
+	int32_t precision;
+	int32_t filtered;
+
+	/* centres and standard deviations in ms of the pulse widths learned */
+	double width[STATS_WIDTHS];
+	double deviation[STATS_WIDTHS];
+};
+
+struct statsSegment {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t lines;
+	int64_t started;
+	struct lineStats line[STATS_LINES];
+};
+
+#endif
@@ -34,6 +34,7 @@
 # include <unistd.h>
 # include <stdio.h>
 #endif
+#include <stdint.h>
 
 /*
  * This driver supports a reference clock attached thru shared memory
@@ -85,15 +86,74 @@ struct shmTime {
 	int    precision;
 	int    nsamples;
 	int    valid;
-	int    dummy[10]; 
+	unsigned clockTimeStampNSec;	/* Unsigned ns timestamps */
+	unsigned receiveTimeStampNSec;	/* Unsigned ns timestamps */
+	int    dummy[8]; 
 };
+
+/*
+ * Extended segment, the structure above followed by a ring of the last
+ * SHM_SAMPLES samples written, so none are lost between polls. Each slot is
+ * a seqlock, its sequence odd while being written, and head counts every
+ * sample ever written. Must match radioclkd.
+ */
+#define SHM_RING_MAGIC   0x52434c4b
+#define SHM_RING_VERSION 1
+#define SHM_SAMPLES      64
+
+struct shmSample {
+	uint32_t seq;
+	uint32_t index;
+	int64_t  clockSec;
+	int64_t  receiveSec;
+	uint32_t clockNSec;
+	uint32_t receiveNSec;
+	int32_t  leap;
+	int32_t  precision;
+};
+
+struct shmRing {
+	struct shmTime legacy;
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t head;
+	struct shmSample sample[SHM_SAMPLES];
+};
+
+#if defined(__GNUC__)
+# define shm_barrier()   __sync_synchronize()
+#else
+# define shm_barrier()   do { } while (0)
+#endif
+
+/*
+ * Per unit state of the reader of the ring, the next sample wanted and
+ * whether the segment attached is big enough to hold a ring
+ */
+struct shmUnit {
+	int      extended;
+	int      started;
+	uint32_t next;
+};
+static struct shmUnit shm_unit[10];
+
 struct shmTime *getShmTime (int unit) {
 #ifndef SYS_WINNT
 	int shmid=0;
 
 	assert (unit<10); /* MAXUNIT is 4, so should never happen */
-	shmid=shmget (0x4e545030+unit, sizeof (struct shmTime), 
+	/* the extended segment if possible, but a segment already created
+	   with the original size can only be attached with that size */
+	shm_unit[unit].extended=1;
+	shm_unit[unit].started=0;
+	shmid=shmget (0x4e545030+unit, sizeof (struct shmRing), 
 		      IPC_CREAT|(unit<2?0700:0777));
+	if (shmid==-1) {
+		shm_unit[unit].extended=0;
+		shmid=shmget (0x4e545030+unit, sizeof (struct shmTime), 
+			      IPC_CREAT|(unit<2?0700:0777));
+	}
 	if (shmid==-1) { /*error */
 		msyslog(LOG_ERR,"SHM shmget (unit %d): %s",unit,strerror(errno));
 		return 0;
@@ -208,6 +268,106 @@ shm_shutdown(
 }
 
 
+/*
+ * shm_sample - hand one sample to the refclock filter
+ */
+static int
+shm_sample(
+	struct peer *peer,
+	struct timeval *tvr,
+	struct timeval *tvt,
+	int leap,
+	int precision
+	)
+{
+	struct refclockproc *pp;
+	struct tm *t;
+
+	pp = peer->procptr;
+	TVTOTS(tvr,&pp->lastrec);
+	pp->lastrec.l_ui += JAN_1970;
+	pp->polls++;
+	t=gmtime (&tvt->tv_sec);
+	pp->day=t->tm_yday+1;
+	pp->hour=t->tm_hour;
+	pp->minute=t->tm_min;
+	pp->second=t->tm_sec;
+	pp->msec=0;
+	pp->usec=tvt->tv_usec;
+	peer->precision=precision;
+	pp->leap=leap;
+	return refclock_process(pp);
+}
+
+
+/*
+ * shm_drain - hand every sample in the ring not seen before to the refclock
+ * filter. Returns the number of samples taken, or -1 if the segment does
+ * not carry a ring.
+ */
+static int
+shm_drain(
+	int unit,
+	struct peer *peer,
+	struct shmRing *ring
+	)
+{
+	struct shmUnit *su = &shm_unit[unit];
+	struct shmSample copy;
+	volatile struct shmSample *sample;
+	struct timeval tvr;
+	struct timeval tvt;
+	uint32_t head, seq;
+	int n=0, bad=0;
+
+	if (!su->extended || ring->magic!=SHM_RING_MAGIC ||
+	    ring->version!=SHM_RING_VERSION || ring->size!=SHM_SAMPLES)
+		return -1;
+	head=ring->head;
+	shm_barrier();
+
+	/* start with the latest sample, and again if the writer restarted */
+	if (!su->started || (int32_t)(head-su->next)<0) {
+		su->next=head-(head>0 ? 1 : 0);
+		su->started=1;
+	}
+	if (head-su->next>SHM_SAMPLES) {
+		msyslog (LOG_NOTICE, "SHM: %u samples lost from shared memory",
+			 (unsigned)(head-su->next-SHM_SAMPLES));
+		su->next=head-SHM_SAMPLES;
+	}
+
+	for (; su->next!=head; su->next++) {
+		sample=&ring->sample[su->next%SHM_SAMPLES];
+		seq=sample->seq;
+		shm_barrier();
+		copy.index=sample->index;
+		copy.clockSec=sample->clockSec;
+		copy.clockNSec=sample->clockNSec;
+		copy.receiveSec=sample->receiveSec;
+		copy.receiveNSec=sample->receiveNSec;
+		copy.leap=sample->leap;
+		copy.precision=sample->precision;
+		shm_barrier();
+		if ((seq & 1) || seq!=sample->seq || copy.index!=su->next) {
+			bad++;
+			continue;
+		}
+		tvr.tv_sec=copy.receiveSec;
+		tvr.tv_usec=copy.receiveNSec/1000;
+		tvt.tv_sec=copy.clockSec;
+		tvt.tv_usec=copy.clockNSec/1000;
+		if (!shm_sample(peer, &tvr, &tvt, copy.leap, copy.precision))
+			bad++;
+		else
+			n++;
+	}
+	if (bad)
+		refclock_report(peer, CEVNT_BADTIME);
+	return n;
+}
+
+
 /*
  * shm_poll - called by the transmit procedure
  */
@@ -236,25 +396,48 @@ shm_poll(
 		refclock_report(peer, CEVNT_FAULT);
 		return;
 	}
+
+	/* take every new sample from the ring of an extended segment */
+	switch (shm_drain(unit, peer, (struct shmRing *)up)) {
+	    case -1:
+		break;
+	    case 0:
+		up->valid=0;
+		refclock_report(peer, CEVNT_TIMEOUT);
+		if (!(pp->sloppyclockflag & CLK_FLAG3))
+			msyslog (LOG_NOTICE, "SHM: no new value found in shared memory");
+		return;
+	    default:
+		up->valid=0;
+		refclock_receive(peer);
+		return;
+	}
+
 	if (up->valid) {
 		struct timeval tvr;
 		struct timeval tvt;
-		struct tm *t;
 		int ok=1;
+		int leap=0, precision=0;
 		switch (up->mode) {
 		    case 0: {
 			    tvr.tv_sec=up->receiveTimeStampSec;
 			    tvr.tv_usec=up->receiveTimeStampUSec;
 			    tvt.tv_sec=up->clockTimeStampSec;
 			    tvt.tv_usec=up->clockTimeStampUSec;
+			    leap=up->leap;
+			    precision=up->precision;
 		    }
 		    break;
 		    case 1: {
 			    int cnt=up->count;
+			    shm_barrier();
 			    tvr.tv_sec=up->receiveTimeStampSec;
 			    tvr.tv_usec=up->receiveTimeStampUSec;
 			    tvt.tv_sec=up->clockTimeStampSec;
 			    tvt.tv_usec=up->clockTimeStampUSec;
+			    leap=up->leap;
+			    precision=up->precision;
+			    shm_barrier();
 			    ok=(cnt==up->count);
 		    }
 		    break;
@@ -262,26 +445,15 @@ shm_poll(
 			msyslog (LOG_ERR, "SHM: bad mode found in shared memory: %d",up->mode);
 		}
 		up->valid=0;
-		if (ok) {
-			TVTOTS(&tvr,&pp->lastrec);
-			pp->lastrec.l_ui += JAN_1970;
-			/* pp->lasttime = current_time; */
-			pp->polls++;
-			t=gmtime (&tvt.tv_sec);
-			pp->day=t->tm_yday+1;
-			pp->hour=t->tm_hour;
-			pp->minute=t->tm_min;
-			pp->second=t->tm_sec;
-			pp->msec=0;
-			pp->usec=tvt.tv_usec;
-			peer->precision=up->precision;
-			pp->leap=up->leap;
-		} 
-		else {
+		if (!ok) {
 			refclock_report(peer, CEVNT_FAULT);
 			msyslog (LOG_NOTICE, "SHM: access clash in shared memory");
 			return;
 		}
+		if (!shm_sample(peer, &tvr, &tvt, leap, precision)) {
+			refclock_report(peer, CEVNT_BADTIME);
+			return;
+		}
 	}
 	else {
 		refclock_report(peer, CEVNT_TIMEOUT);
@@ -289,10 +461,6 @@ shm_poll(
 			msyslog (LOG_NOTICE, "SHM: no new value found in shared memory");
 		return;
 	}
-	if (!refclock_process(pp)) {
-		refclock_report(peer, CEVNT_BADTIME);
-		return;
-	}
 	refclock_receive(peer);
 }
 